@@ -336,6 +336,13 @@
 #define DEFAULT_PGM_PPM_CENTER_THROTTLE		122	// 4*122+1000=1488 (used in bidirectional mode)
 #define DEFAULT_PGM_BEC_VOLTAGE_HIGH		0	// 0=Low		1+= High or higher
 #define DEFAULT_PGM_ENABLE_TEMP_PROT	 	1 	// 1=Enabled 	0=Disabled
+#define DEFAULT_PGM_COMM_PWM_SYNC			0	// 0=Off		1-8=Snap window in 1/8deg units
+#define DEFAULT_PGM_THROTTLE_CURVE			1	// 1=Linear	2=ThrustLinear	3=Expo
+#define DEFAULT_PGM_THROTTLE_CURVE_AMOUNT	50	// Curve blend with linear in percent (0-100)
+#define DEFAULT_PGM_GOV_D_GAIN				0	// 0=Off		1-13 as P gain
+#define DEFAULT_PGM_GOV_FEED_FORWARD		0	// Governor requested pwm fed forward in percent (0-100)
+#define DEFAULT_PGM_GOV_GAIN_SCHEDULE		0	// 0=Off		1=Scale gains by GOV_SCHED_TABLE
+#define DEFAULT_PGM_CURRENT_LIMIT			0	// 0=Off		1-255=Current limit in A
 //**** **** **** **** ****
 // Constant definitions for main
 #if (MODE==MAIN_MODE)
@@ -382,11 +389,163 @@
 #define TEMP_CHECK_RATE 		8 // Number of adc conversions for each check of temperature (the other conversions are used for voltage)
 #endif
 
+//**** **** **** **** ****
+// RC pulse filter (applied to accepted pulses in pca_int, see rcp_filter)
+#define RCP_FILTER				0	// 0=None	1=Median of 3	2=Bounded slew
+#define RCP_FILTER_SLEW			48	// Bounded slew: largest pulse to pulse change passed through at once
+#define RCP_FILTER_SLEW_HOLD	2	// Bounded slew: pulses held before a larger change is accepted
+#define RCP_OUTLIER_LIMIT		10	// Out of range pulses (leaky count) before the pulse is set to zero
+
+//**** **** **** **** ****
+// Power supply voltage (see check_temp_voltage_and_limit_power)
+#define ADC_DMA_SAMPLES			16	// Circular dma buffer length, averaged when read
+#define ADC_DECIMATE_SHIFT		2	// 16 12bit samples decimated to one 14bit value
+#define ADC_MV_Q8				567	// Supply mV per decimated count (0x100 is 1.00) - 3.3V reference, 11:1 divider
+#define LIPO_CELL_MAX_MV		4350	// Highest cell voltage expected at arming
+#define VOLT_LIMIT_HYST_SHIFT	5	// Recover above Lipo_Adc_Limit + Lipo_Adc_Limit>>5 (about 3%)
+#define PWM_LIMIT_VOLT_MIN		0x40	// Lowest pwm limit set by the low voltage limit
+
+//**** **** **** **** ****
+// Current sense (see current_limit_update)
+#define CURRENT_ADC_OFFSET		0	// Current sense adc count at zero current
+#define CURRENT_MA_PER_COUNT	40	// Current sense scale - 12bit adc, 3.3V reference, 0.5mohm shunt, gain 40
+#define CURRENT_CUT_SHIFT		9	// Pwm limit cut per update is 1 step plus 1 step per 512mA over the limit
+#define PWM_LIMIT_CURRENT_MIN	0x10	// Lowest pwm limit set by the current limit
+
+//**** **** **** **** ****
+// FET thermal model (see thermal_model_update)
+#define TEMP_LIMIT_C			110	// FET temperature limit (degC)
+#define THERM_DERATE_BAND_C		15	// Pwm limit derates linearly over this band below TEMP_LIMIT_C
+#define THERM_RTH_CW			20	// FET to ambient thermal resistance (degC/W)
+#define THERM_TAU_SHIFT			10	// Thermal time constant is 1024 updates of 32ms (about 33s)
+#define THERM_PREDICT_SHIFT		3	// Derate on the temperature 1/8 of the way to steady state (about 4s ahead)
+#define THERM_GAIN_SHIFT		10	// Loss scale learning - 1degC residual moves the scale by 1/1024 per update
+#define THERM_GAIN_MIN			0x40	// Loss scale limits (0x100 is 1.00)
+#define THERM_GAIN_MAX			0x400
+#define THERM_RDS_MOHM			4	// On resistance in the current path (two FETs)
+#define THERM_EST_MW			3000	// Estimated conduction loss at full pwm without current sense
+#define THERM_COMM_MW_PER_KERPM	4	// Estimated switching and commutation loss per 1000 eRPM
+#define PWM_LIMIT_TEMP_MIN		0x40	// Lowest pwm limit set by the temperature limit
+
+//**** **** **** **** ****
+// Zero cross filter (see zc_filter_update)
+#define ZC_BANDS				4	// Comm_Period4x bands - up to 0x0500, 0x0a00, 0x0f00 and above
+#define ZC_DEPTH_MAX			8	// Most good comparator readings required
+#define ZC_RATE_SHIFT			4	// False crossing rate averaged over about 16 scans
+#define ZC_RATE_HIGH			0x40	// Deepen above 0.25 false crossings per scan (0x100 is 1.00)
+#define ZC_RATE_LOW				0x08	// Shallow below 0.03 false crossings per scan
+#define ZC_ADAPT_SCANS			64	// Scans in a band between depth changes
+#define ZC_STARTUP_DEPTH		30	// Good comparator readings required during the startup phase
+#define ZC_STARTUP_FAST_READS	1	// Fast consecutive readings per good reading during the startup phase
+
+//**** **** **** **** ****
+// Commutation period tracker (see comm_tracker_update)
+#define TRK_ALPHA_SHIFT			1	// Period correction 1/2 of the residual
+#define TRK_BETA_SHIFT			3	// Rate correction 1/8 of the residual
+#define TRK_JITTER_SHIFT		4	// Jitter averaged over about 16 steps
+
+//**** **** **** **** ****
+// Commutation (see comm_step and COMM_TABLE)
+#define PH_A					0
+#define PH_B					1
+#define PH_C					2
+#define COMM_RPM_OUT_SET		0x01	// Set rpm output on entering the step
+#define COMM_RPM_OUT_CLEAR		0x02	// Clear rpm output on entering the step
+#define COMM_LOW_RPM_LIMIT		0x04	// Update the low rpm power limit after the zero cross
+#define COMM_EVAL_COMP			0x08	// Evaluate comparator and restart the comm wait after the zero cross
+
+//**** **** **** **** ****
+// Phase asymmetry compensation (see phase_corr_update)
+#define PHASE_STEPS				6
+#define PHASE_CORR_SHIFT		3	// 1/8 of each revolution's residual offset added to the correction
+#define PHASE_CORR_MAX_SHIFT	3	// Correction limited to 1/8 step (7.5deg)
+
+//**** **** **** **** ****
+// Demag predictor (see demag_predict)
+#define DEMAG_GAIN_INIT			0x08	// Full pwm gives demag of Comm_Period4x/32 (7.5deg)
+#define DEMAG_GAIN_MIN			0x02
+#define DEMAG_GAIN_MAX			0x40
+#define DEMAG_LEARN_UP_SHIFT	3	// Gain raised by 1/8 on each detected demag
+#define DEMAG_LEARN_DOWN_SHIFT	6	// Gain lowered by 1/64 on each clean step
+
+//**** **** **** **** ****
+// Bidirectional reversal (see reverse_track)
+#define REV_BRAKE_PERIOD		0x2000	// Brake until Comm_Period4x is longer than this (~9800 eRPM)
+#define REV_SETTLE_US			200	// Wait after the brake is released for the winding flyback to decay
+#define REV_SAMPLE_US			10	// Comparator sample interval while confirming a change
+#define REV_DEBOUNCE			3	// Samples in a row at the new level before a comparator change counts as a crossing
+#define REV_WINDOW_US			2000	// Coast window, sampled once per housekeeping pass
+#define REV_CYCLES_PER_US		72	// Cycle_Count counts per us (core clock in MHz)
+#define REV_RATE_SHIFT			2	// Crossing rate averaged over about 4 windows
+#define REV_RATE_ZERO			0x02	// Crossing rate (4 fractional bits) taken as zero speed (1/8 per window)
+#define REV_WINDOWS_MAX			250	// Windows (about 0.5s of coasting) before giving up and doing a full stop
+
+enum {
+	REV_TRACKING, REV_RESTARTED, REV_ABORTED
+};
+
+enum {
+	REV_BRAKING, REV_SETTLING, REV_COASTING
+};
+
+//**** **** **** **** ****
+// Telemetry (see telem_step)
+#define TELEM_PHASE_CORR		0	// Append the per step timing corrections to the KISS frame
+#if (TELEM_PHASE_CORR==1)
+#define TELEM_FRAME_SIZE		(10+PHASE_STEPS)	// KISS frame then step corrections in 1/8deg before CRC8
+#else
+#define TELEM_FRAME_SIZE		10	// KISS frame - temp, voltage, current, consumption, eRPM and CRC8
+#endif
+#define MAH_MA_TICKS			28125000	// mA timer2 ticks (about 128us) per mAh
+
+//**** **** **** **** ****
+// Timer2 tick poll (see timer2_tick_poll)
+#define T2_TICK_CYCLES			9216	// Cycle_Count counts per timer2 tick (128us at 72MHz)
+#define T2_TICKS_MAX			8	// Ticks caught up on one poll, older ticks are dropped
+#define T2H_TICKS				256	// Timer2 ticks per timer2 high byte overflow (about 32ms)
+
+//**** **** **** **** ****
+// Governor (see governor_update)
+#define GOV_TICKS				8	// Number of timer2L overflows (about 128us) per governor update
+#define GOV_SPEED_K				800000	// Speed in 100 eRPM units is GOV_SPEED_K/Comm_Period4x
+#define GOV_Q					16	// Fractional pwm bits of governor terms
+#define GOV_P_SHIFT				6	// P gain 1.00 gives 1 pwm step per 400 eRPM error
+#define GOV_I_SHIFT				0	// I gain 1.00 integrates 1 pwm step per 25600 eRPM error per update
+#define GOV_D_SHIFT				6	// D gain 1.00 gives 1 pwm step per 400 eRPM change per update
+#define GOV_ERR_MAX				2047	// Speed error and change limit (100 eRPM units)
+#define GOV_VOLT_COMP_MIN		0x80	// Feed forward voltage compensation limits (0x100 is 1.00)
+#define GOV_VOLT_COMP_MAX		0x200
+#define GOV_FF_LEARN_PWM		0x20	// Minimum pwm for learning speed per pwm step
+#define GOV_FF_LEARN_SHIFT		6	// Speed per pwm step averaged over about 64 updates
+#define GOV_SCHED_SPEEDS		5	// Gain schedule target speed points, GOV_SCHED_SPEED_SHIFT apart
+#define GOV_SCHED_SPEED_SHIFT	9	// 51200 eRPM between speed points
+#define GOV_SCHED_PWMS			5	// Gain schedule pwm points, GOV_SCHED_PWM_SHIFT apart
+#define GOV_SCHED_PWM_SHIFT		6	// 64 pwm steps between pwm points
+#define GOV_SCHED_SIZE			(GOV_SCHED_SPEEDS*GOV_SCHED_PWMS)
+
+//**** **** **** **** ****
+// Diagnostics (set to 1 to enable)
+#define COMM_TRACE				0	// Record a binary trace entry for every commutation step
+#define STAGE_PROFILE			0	// Keep cycle count statistics for each main loop stage
+#define RUN_STATS				0	// Keep max eRPM, sync loss and step timing error statistics
+#define THROTTLE_LATENCY		0	// Histogram latency from RC pulse to pwm and gate change
+#define RCP_DETECT_TRACE		0	// Record detected input type and time taken to arm
+#define GOV_STATS				0	// Keep governor step response and disturbance rejection statistics
+#define THROTTLE_LUT_CHECK		0	// Check the throttle tables against the original 8 bit chain after each rebuild
+
 //**** **** **** **** ****
 
 typedef void (*FETFuncPtr)();
 static FETFuncPtr DPTR = NULL;
 
+typedef struct {
+	int32 High; // Phase with pfet on
+	int32 Low; // Phase with nfet pwm
+	int32 Comp; // Phase evaluated by the comparator
+	boolean Rising; // Comparator output changes from low to high at zero cross
+	int32 Tasks; // COMM_* step tasks
+} CommStep;
+
 int32 Temp1, Temp2, Temp3, Temp4, Temp5, Temp6, Temp7, Temp8;
 int32 A, C, AE, TL1;
 
@@ -483,6 +642,59 @@ void Set_Comp_Phase_C(void) {
 }
 ;
 
+// Per phase switches indexed by PH_A, PH_B and PH_C
+FETFuncPtr PFET_ON[3] = { ApFET_on, BpFET_on, CpFET_on };
+FETFuncPtr PFET_OFF[3] = { ApFET_off, BpFET_off, CpFET_off };
+FETFuncPtr NFET_ON[3] = { AnFET_on, BnFET_on, CnFET_on };
+FETFuncPtr NFET_OFF[3] = { AnFET_off, BnFET_off, CnFET_off };
+FETFuncPtr SET_COMP_PHASE[3] = { Set_Comp_Phase_A, Set_Comp_Phase_B, Set_Comp_Phase_C };
+
+void Signal_Wire_Tx(uint8 b) { // Transmit one byte on the RC signal wire
+	(void) b;
+}
+;
+
+int32 Signal_Wire_Rx(void) { // Byte received on the RC signal wire while disarmed (-1 when none)
+	return -1;
+}
+;
+
+uint32 Cycle_Count(void) { // Free running cpu cycle counter (DWT CYCCNT)
+	return 0;
+}
+;
+
+void Adc_Start_Dma(uint16 *Buf, int32 Samples) { // Start continuous power supply voltage conversion into a circular dma buffer
+	(void) Buf;
+	(void) Samples;
+}
+;
+
+int32 Board_Temp_Read(void) { // Latest FET temperature sensor reading (degC)
+	return 0;
+}
+;
+
+void Telem_Uart_Tx(uint8 b) { // Transmit one byte on the telemetry uart (buffered by the uart)
+	(void) b;
+}
+;
+
+boolean Telem_Requested(void) { // Telemetry frame requested since last call
+	return false;
+}
+;
+
+uint16 Adc_Current_Read(void) { // Latest current sense sample, conversion triggered by the pwm timer in the middle of pwm on
+	return 0;
+}
+;
+
+boolean Comp_Out_Read(void) { // Comparator output for the phase selected by Set_Comp_Phase_X
+	return false;
+}
+;
+
 //**** **** **** **** ****
 // RAM definitions
 
@@ -495,18 +707,40 @@ int32 Startup_Rot_Cnt; // Startup phase rotations counter
 int32 Startup_Ok_Cnt; // Startup phase ok comparator waits counter (incrementing)
 int32 Demag_Detected_Metric; // Metric used to gauge demag event frequency
 int32 Demag_Pwr_Off_Thresh; // Metric threshold above which power is cut
+int32 Demag_Gain; // Demag duration per unit of phase current proxy (0x100 is 1.00), learned
+int32 Demag_Est_Wt; // Predicted demag duration after commutation (timer3 counts)
+boolean Demag_Cut_Scheduled; // Predicted demag outlasts the longest zero cross blanking
 int32 Low_Rpm_Pwr_Slope; // Sets the slope of power increase for low rpms
 
 int32 Prev_Comm; // Previous commutation timer3 timestamp (lo byte)
 int32 Comm_Period4x; // Timer3 counts between the last 4 commutations (lo byte)
 int32 Comm_Phase; // Current commutation phase
+int32 Comm_High; // Phase with pfet on in the present step
+int32 Comm_Low; // Phase with nfet pwm in the present step
+int32 Comm_Prev_Low; // Phase with nfet pwm in the step before the last low side move
 int32 Comparator_Read_Cnt; // Number of comparator reads done
-
-int32 Gov_Target; // Governor target (lo byte)
-int32 Gov_Integral; // Governor integral error (lo byte)
-int32 Gov_Integral_X; // Governor integral error (ex byte)
-int32 Gov_Proportional; // Governor proportional error
-int32 Gov_Prop_Pwm; // Governor calculated new pwm based upon proportional error
+int32 Zc_Wrong_Step; // Wrong comparator readings in the present zero cross scan
+int32 Zc_Depth[ZC_BANDS]; // Good comparator readings required per band (adapted)
+int32 Zc_Wrong_Rate[ZC_BANDS]; // False crossings per scan per band (0x100 is 1.00)
+int32 Zc_Adapt_Cnt[ZC_BANDS]; // Scans since last depth change per band
+uint32 Zc_Scan_Cnt[ZC_BANDS]; // Zero cross scans per band
+uint32 Zc_Wrong_Cnt[ZC_BANDS]; // Wrong comparator readings (comp_read_wrong) per band
+
+int32 Gov_Target; // Governor target speed (100 eRPM units)
+int32 Gov_Integral; // Governor integral term (pwm with GOV_Q fractional bits)
+int32 Gov_Proportional; // Governor proportional term (pwm with GOV_Q fractional bits)
+int32 Gov_Derivative; // Governor derivative term (pwm with GOV_Q fractional bits)
+int32 Gov_Prev_Speed; // Speed at previous governor update (100 eRPM units)
+int32 Gov_Tick_Cnt; // Timer2 ticks to next governor update (decrementing)
+uint32 T2_Tick_Start; // Cycle count of the last timer2 tick run by timer2_tick_poll
+int32 T2h_Tick_Cnt; // Timer2 ticks to the next t2h_int work (decrementing)
+int32 Gov_P_Sched[GOV_SCHED_SIZE]; // Scheduled governor gains (0x100 is 1.00), see GOV_SCHED_TABLE
+int32 Gov_I_Sched[GOV_SCHED_SIZE];
+int32 Gov_D_Sched[GOV_SCHED_SIZE];
+int32 Gov_FF_Gain; // Governor feed forward (0x100 is 1.00)
+int32 Gov_Volt_Comp; // Feed forward voltage compensation Lipo_Adc_Reference/Lipo_Adc_Value (0x100 is 1.00)
+int32 Gov_Speed_Per_Pwm; // Learned speed per pwm step at Lipo_Adc_Reference (8 fractional bits, 0 until learned)
+int32 Gov_Load_Input; // Pwm steps fed forward ahead of an expected load (0 unless a load input is fitted)
 int32 Gov_Arm_Target; // Governor arm target value
 int32 Gov_Active; // Governor active (enabled when speed is above minimum)
 
@@ -514,7 +748,15 @@ int32 Wt_Advance; // Timer3 counts for commutation advance timing (lo byte)
 int32 Wt_Zc_Scan; // Timer3 counts from commutation to zero cross scan (lo byte)
 int32 Wt_Zc_Timeout; // Timer3 counts for zero cross scan timeout (lo byte)
 int32 Wt_Comm; // Timer3 counts from zero cross to commutation
+int32 Trk_Period; // Tracked commutation step time (8 fractional bits)
+int32 Trk_Rate; // Tracked change of step time per step (8 fractional bits)
+int32 Zc_Jitter; // Average step time residual against the tracker prediction (8 fractional bits)
+int32 Phase_Dev[PHASE_STEPS]; // Step time deviation from the mean over the last revolution (8 fractional bits)
+int32 Phase_Corr[PHASE_STEPS]; // Learned zero cross offset of each step, taken off its commutation wait (8 fractional bits)
+int32 Phase_Corr_Max; // Largest correction magnitude (8 fractional bits)
 int32 Next_Wt; // Timer3 counts for next wait period
+int32 Comm_Sync_Window; // Timer1 counts before a pwm edge within which commutation is held for the edge
+int32 Comm_Sync_Eighths; // Decoded pwm sync window (1/8deg units, 0 is off)
 
 int32 Rcp_PrePrev_Edge; // RC pulse pre previous edge pca timestamp (lo byte)
 int32 Rcp_Edge; // RC pulse edge pca timestamp (lo byte)
@@ -524,6 +766,13 @@ int32 New_Rcp; // New RC pulse value in pca counts
 int32 Prev_Rcp_Pwm_Freq; // Previous RC pulse pwm frequency (used during pwm frequency measurement)
 int32 Curr_Rcp_Pwm_Freq; // Current RC pulse pwm frequency (used during pwm frequency measurement)
 int32 Rcp_Stop_Cnt; // Counter for RC pulses below stop value
+int32 Rcp_Filter_Raw[2]; // Previous two raw RC pulses (median filter)
+int32 Rcp_Filter_Out; // Previous filtered RC pulse
+int32 Rcp_Filter_Hold_Cnt; // Consecutive pulses held by the slew filter
+int32 Rcp_Outlier_Cnt; // Leaky count of out of range pulses
+int32 Rcp_Filter_Subst_Raw; // Raw pulse that the filter replaced on the previous pulse (-1 if none)
+uint32 Rcp_Glitch_Cnt; // Pulses rejected as glitches (outliers and replaced pulses not confirmed)
+uint32 Rcp_Filter_Lag_Cnt; // Pulses by which a genuine throttle change was delayed
 int32 Auto_Bailout_Armed; // Set when auto rotation bailout is armed
 
 int32 Pwm_Limit; // Maximum allowed pwm
@@ -541,11 +790,46 @@ int32 Main_Spoolup_Time_15x; // Main spoolup time x15
 
 int32 Lipo_Adc_Reference; // Voltage reference adc value (lo byte)
 int32 Lipo_Adc_Limit; // Low voltage limit adc value (lo byte)
+int32 Lipo_Adc_Value; // Latest power supply voltage adc value
+int32 Lipo_Cells; // Number of lipo cells detected at arming
+int32 Pwm_Limit_Voltage; // Pwm limit set by the low voltage limit
+uint16 Adc_Dma_Buf[ADC_DMA_SAMPLES]; // Power supply voltage samples written by dma
+int32 Current_Ma; // Latest motor current (mA)
+int32 Pwm_Limit_Current = 0xff; // Pwm limit set by the current limit
+uint32 Charge_Ma_Ticks; // Charge not yet counted in Consumed_Mah (mA timer2 ticks)
+int32 Consumed_Mah; // Charge drawn since power up (mAh)
+
+uint32 Rev_Brake_Start; // Cycle count when the direction change brake began (0 when not braking)
+uint32 Rev_Cycles; // Cycles from direction change to restart for the last fast reversal
+int32 Rev_Count; // Fast reversals done
+int32 Rev_Fallback_Cnt; // Reversals that fell back to a full stop and restart
+boolean Rev_Tracking; // Coasting and tracking the bemf crossing rate down to zero
+int32 Rev_Rate; // Average bemf crossings per coast window (4 fractional bits)
+int32 Rev_Windows; // Coast windows taken in this reversal
+int32 Rev_Phase; // Brake, flyback settle or coast window (REV_BRAKING...)
+uint32 Rev_Phase_Start; // Cycle count when Rev_Phase began
+boolean Rev_Level; // Debounced comparator level on the floating phase
+int32 Rev_Crossings; // Bemf crossings so far in the coast window
+
+uint8 Telem_Frame[TELEM_FRAME_SIZE]; // Frame being sent
+int32 Telem_Pos = TELEM_FRAME_SIZE; // Next byte of Telem_Frame to send (TELEM_FRAME_SIZE when idle)
+uint8 Telem_Crc; // CRC8 of the bytes sent so far
 int32 Adc_Conversion_Cnt; // Adc conversion counter
 
-int32 Current_Average_Temp; // Current average temperature (lo byte ADC reading, assuming hi byte is 1)
-
-int32 Ppm_Throttle_Gain; // Gain to be applied to RCP value for PPM input
+int32 Current_Average_Temp; // Current FET temperature sensor reading (degC)
+boolean Therm_Init; // Thermal model started from the sensor
+int32 Therm_Model; // Modelled FET temperature (degC, 8 fractional bits)
+int32 Therm_Gain = 0x100; // Learned scale of the loss estimate (0x100 is 1.00)
+int32 Therm_Ambient; // Ambient temperature estimate (degC, 8 fractional bits)
+int32 Therm_Power_Mw; // Estimated FET dissipation (mW)
+int32 Pwm_Limit_Temp = 0xff; // Pwm limit set by the temperature limit
+
+int32 Ppm_Throttle_Gain; // Gain to be applied to RCP value for PPM input (16 fractional bits)
+uint8 Ppm_Throttle_Lut[RCP_MAX + 1]; // PPM pulse (minimum subtracted) to New_Rcp, gain applied
+uint8 Throttle_Lut[2][RCP_MAX + 1]; // New_Rcp to Requested_Pwm, indexed [F.RCP_PPM][New_Rcp]
+int32 Rcp_Gain_Enabled; // Set when the 1.0625 and motor gain scaling applies to pwm input
+int32 Rcp_Gain_Shift; // Motor gain correction is pwm>>Rcp_Gain_Shift (0=no correction)
+int32 Rcp_Gain_Pos; // Set when the motor gain correction is positive
 
 int32 Skip_T2_Int; // Set for 50MHz MCUs when timer 2 interrupt shall be ignored
 int32 Skip_T2h_Int; // Set for 50MHz MCUs when timer 2 high interrupt shall be ignored
@@ -555,12 +839,132 @@ int32 Timer0_Overflow_Value; // Remaining timer 0 wait time used with 50MHz MCUs
 //zzzISEG AT 0D0h
 int32 Tag_Temporary_Storage[48]; // Temporary storage for tags when updating "Eeprom"
 
+#if (COMM_TRACE==1)
+#define COMM_TRACE_SIZE			128	// Number of trace records (must be a power of 2)
+#define COMM_TRACE_DUMP_CMD		'T'	// Signal wire command that dumps the trace in wait_for_power_on
+
+struct CommTraceRec {
+	uint16 Comm_Period4x;
+	uint16 Wt_Comm;
+	uint16 Wt_Zc_Scan;
+	uint8 Demag_Detected_Metric;
+	uint8 Comparator_Read_Cnt;
+	uint8 Current_Pwm_Limited;
+	uint8 runState; // Step that was just completed
+} Comm_Trace[COMM_TRACE_SIZE];
+
+uint32 Comm_Trace_Cnt; // Number of records written (wraps the ring at COMM_TRACE_SIZE)
+#endif
+
+#if (STAGE_PROFILE==1)
+enum {
+	PROF_EVAL_COMP, // evaluate_comparator_integrity at the start of the step
+	PROF_SETUP_COMM_WAIT, // setup_comm_wait at the start of the step
+	PROF_WAIT_COMP_OUT, // wait_for_comp_out_high/low
+	PROF_POWER_LIMIT, // set_pwm_limit_low_rpm
+	PROF_EVAL_COMP_ZC, // evaluate_comparator_integrity after the zero cross (COMM_EVAL_COMP steps)
+	PROF_SETUP_COMM_WAIT_ZC, // setup_comm_wait after the zero cross (COMM_EVAL_COMP steps)
+	PROF_WAIT_FOR_COMM, // wait_for_comm
+	PROF_COMM, // comm_step
+	PROF_CALC_NEXT_COMM, // calc_next_comm_timing
+	PROF_WAIT_ADVANCE, // wait_advance_timing
+	PROF_CALC_WAIT_TIMES, // calc_new_wait_times
+	PROF_WAIT_ZC_SCAN, // wait_before_zc_scan
+	PROF_HOUSEKEEPING, // DoHousekeeping
+	PROF_STAGES
+};
+
+struct StageProfileRec {
+	uint32 Min; // Cycles
+	uint32 Max;
+	uint32 Sum; // Mean is Sum/Cnt
+	uint32 Cnt;
+} Stage_Profile[PROF_STAGES][run6 + 1];
+
+#define PROFILE(s, f) do {uint32 _prof_t=Cycle_Count(); f; profile_stage(s, Step, Cycle_Count()-_prof_t);} while (0)
+#else
+#define PROFILE(s, f) f
+#endif
+
+#if (RUN_STATS==1)
+#define STEP_ERR_BINS			16	// Step timing error histogram bins, each 1/64 of the mean step time
+
+int32 Run_Min_Comm_Period4x; // Shortest Comm_Period4x seen in run (eRPM = 80000000/Comm_Period4x)
+int32 Sync_Loss_Cnt; // Run exits on a stall while throttle was still requested
+uint32 Step_Prev_Cycles; // Cycle count at previous step
+uint32 Step_Mean_Cycles; // Sliding average of step time in cycles
+uint32 Step_Err_Hist[STEP_ERR_BINS]; // Histogram of |step time - mean|, last bin holds all larger errors
+#endif
+
+#if (THROTTLE_LATENCY==1)
+#define LAT_BINS				32	// Latency histogram bins, last bin holds all larger latencies
+#define LAT_BIN_SHIFT			9	// Bin width 512 cycles
+#define LAT_TIMEOUT_CYCLES		(LAT_BINS << (LAT_BIN_SHIFT + 3))	// Pending measurement dropped after 8x the histogram span
+
+enum {
+	LAT_PWM_INPUT, LAT_PPM, LAT_ONESHOT125, LAT_INPUTS
+};
+
+int32 Lat_Input; // Input type of the pending measurement
+int32 Lat_Prev_Rcp; // Previous RC pulse value, used to detect a throttle step
+int32 Lat_Prev_Pwm_Limited; // Current_Pwm_Limited before the throttle step
+boolean Lat_Pwm_Pending; // Waiting for Current_Pwm_Limited to change
+boolean Lat_Gate_Pending; // Waiting for the first pwm on cycle with the new duty
+uint32 Lat_Rcp_Cycles; // Cycle count at the RC pulse that carried the step
+uint32 Lat_Pwm_Hist[LAT_INPUTS][LAT_BINS]; // RC pulse to Current_Pwm_Limited change
+uint32 Lat_Gate_Hist[LAT_INPUTS][LAT_BINS]; // RC pulse to first gate pattern change under new duty
+uint32 Lat_Dropped; // Measurements dropped because pwm did not change before the next pulse or timeout
+#endif
+
+#if (RCP_DETECT_TRACE==1)
+enum {
+	RCP_DET_NONE,
+	RCP_DET_PWM_1KHZ,
+	RCP_DET_PWM_2KHZ,
+	RCP_DET_PWM_4KHZ,
+	RCP_DET_PWM_8KHZ,
+	RCP_DET_PWM_12KHZ,
+	RCP_DET_PPM,
+	RCP_DET_ONESHOT125
+};
+
+int32 Rcp_Detect_Mode; // Input type accepted by init_no_signal
+int32 Rcp_Detect_Restarts; // Times signal detection started over
+uint32 Rcp_Detect_Start_Cycles; // Cycle count at first entry to init_no_signal
+uint32 Rcp_Detect_Cycles; // Cycles from first entry to a validated setpoint
+boolean Rcp_Detect_Started;
+#endif
+
+#if (THROTTLE_LUT_CHECK==1)
+#define THROTTLE_LUT_PPM_TOL	3	// Ppm_Throttle_Lut may differ from the 8 bit gain by this (16 bit gain maps max onto RCP_MAX, not 256)
+
+int32 Throttle_Lut_Errors; // Table entries that differ from the original 8 bit chain (0 when equivalent)
+int32 Throttle_Lut_Ppm_Diff; // Largest difference between Ppm_Throttle_Lut and the original 8 bit gain
+#endif
+
+#if (GOV_STATS==1)
+#define GOV_STEP_MIN			20	// Target change (100 eRPM units) that starts a step measurement
+#define GOV_SETTLE_SHIFT		6	// Settled band is Gov_Target>>GOV_SETTLE_SHIFT (about 1.6%)
+#define GOV_SETTLE_HOLD			50	// Updates inside the band before the step counts as settled
+
+int32 Gov_Stats_Target; // Target of the step being measured
+int32 Gov_Stats_Dir; // Direction of the step being measured (+1 up, -1 down)
+boolean Gov_Settling; // Step measurement in progress
+int32 Gov_Settle_Cnt; // Updates since the step
+int32 Gov_In_Band_Cnt; // Consecutive updates inside the settled band
+uint32 Gov_Err_Sq_Mean; // Leaky mean of squared speed error, see gov_stats_rms_err
+int32 Gov_Overshoot; // Largest speed past target after the last step (100 eRPM units)
+int32 Gov_Settle_Updates; // Updates from the last step until settled
+int32 Gov_Max_Droop; // Largest speed below target while settled (100 eRPM units)
+int32 Gov_Peak_Pwm; // Highest governor output pwm
+#endif
+
 
 //**** **** **** **** ****
 
 #define EEPROM_FW_MAIN_REVISION 13
 #define EEPROM_FW_SUB_REVISION 2
-#define EEPROM_LAYOUT_REVISION 19
+#define EEPROM_LAYOUT_REVISION 24
 
 #define DEFAULT_PGM_MULTI_STARTUP_PWR 0
 
@@ -601,6 +1005,13 @@ struct Params {
 	int32 Ppm_Center_Throttle; // center throttle (final value is 4x+1000=1488)
 	int32 Main_Spoolup_Time;
 	int32 Temp_Prot_Enable; // temperature protection enable
+	int32 Comm_Pwm_Sync; // commutation to pwm edge snap window (1/8deg units)
+	int32 Throttle_Curve; // throttle curve shape
+	int32 Throttle_Curve_Amount; // throttle curve blend with linear (percent)
+	int32 Gov_D_Gain;
+	int32 Gov_Feed_Forward; // governor feed forward (percent)
+	int32 Gov_Gain_Schedule; // governor gain schedule enable
+	int32 Current_Limit; // current limit (A)
 
 	int32 Dummy; // EEPROM address for safety reason
 	uint8 Name[16]; // Name tag (16 Bytes)
@@ -609,6 +1020,19 @@ struct Params {
 // Table definitions
 int32 GOV_GAIN_TABLE[] = { 0x02, 0x03, 0x04, 0x06, 0x08, 0x0C, 0x10, 0x18,
 		0x20, 0x30, 0x40, 0x60, 0x80 };
+int32 ZC_DEPTH_INIT[ZC_BANDS] = { 1, 2, 3, 3 }; // Good comparator readings required at power up
+int32 ZC_FAST_READS[ZC_BANDS] = { 2, 2, 2, 3 }; // Fast consecutive readings per good reading
+int32 GOV_ACT_PERIOD[] = { 0x0500, 0x0A00, 0x1200 }; // High, middle and low range (~62500, ~31250 and ~17400 eRPM)
+// Governor gain multipliers (0x100 is 1.00). Rows are target speed points
+// (0, 51200 .. 204800 eRPM), columns pwm points (0, 64 .. 256). Low gains at
+// light load avoid hunting at idle up, high gains at high load hold headspeed
+// through load spikes
+int32 GOV_SCHED_TABLE[GOV_SCHED_SIZE] = {
+		0x60, 0x80, 0xA0, 0xC0, 0xC0,
+		0x80, 0xA0, 0xC0, 0x100, 0x100,
+		0x80, 0xC0, 0x100, 0x140, 0x140,
+		0xA0, 0xC0, 0x100, 0x140, 0x180,
+		0xA0, 0xC0, 0x100, 0x140, 0x180 };
 int32 STARTUP_POWER_TABLE[] = { 0x04, 0x06, 0x08, 0x0C, 0x10, 0x18, 0x20, 0x30,
 		0x40, 0x60, 0x80, 0x0A0, 0x0C0 };
 #if (MODE==MAIN_MODE)
@@ -630,6 +1054,22 @@ int32 TX_PGM_PARAMS_MULTI[] = {13, 13, 4, 5, 6, 13, 5, 3, 3, 3, 2};
 int32 TX_PGM_PARAMS_MULTI[] = { 13, 13, 4, 5, 6, 13, 5, 2, 3, 3, 2 };
 #endif
 #endif
+// Six step commutation sequence indexed by [F.PGM_DIR_REV][runState]. Steps
+// alternately move the high side or the low side to the next phase. Reverse
+// direction is the forward sequence with phases A and C swapped
+CommStep COMM_TABLE[2][6] = { {
+		{ PH_B, PH_C, PH_A, true, 0 }, // Run 1 = B(p-on) + C(n-pwm) - comparator A, low to high
+		{ PH_A, PH_C, PH_B, false, COMM_RPM_OUT_SET | COMM_LOW_RPM_LIMIT }, // Run 2 = A(p-on) + C(n-pwm) - comparator B, high to low
+		{ PH_A, PH_B, PH_C, true, COMM_RPM_OUT_CLEAR }, // Run 3 = A(p-on) + B(n-pwm) - comparator C, low to high
+		{ PH_C, PH_B, PH_A, false, COMM_EVAL_COMP }, // Run 4 = C(p-on) + B(n-pwm) - comparator A, high to low
+		{ PH_C, PH_A, PH_B, true, 0 }, // Run 5 = C(p-on) + A(n-pwm) - comparator B, low to high
+		{ PH_B, PH_A, PH_C, false, COMM_EVAL_COMP } }, { // Run 6 = B(p-on) + A(n-pwm) - comparator C, high to low
+		{ PH_B, PH_A, PH_C, true, 0 },
+		{ PH_C, PH_A, PH_B, false, COMM_RPM_OUT_SET | COMM_LOW_RPM_LIMIT },
+		{ PH_C, PH_B, PH_A, true, COMM_RPM_OUT_CLEAR },
+		{ PH_A, PH_B, PH_C, false, COMM_EVAL_COMP },
+		{ PH_A, PH_C, PH_B, true, 0 },
+		{ PH_B, PH_C, PH_A, false, COMM_EVAL_COMP } } };
 
 //___________________________________________________________________________
 //
@@ -642,6 +1082,17 @@ int32 TX_PGM_PARAMS_MULTI[] = { 13, 13, 4, 5, 6, 13, 5, 2, 3, 3, 2 };
 
 void t0_int_pwm_on_exit(void);
 void t0_int_pwm_off_exit(void);
+void phase_corr_reset(void);
+#if (THROTTLE_LATENCY==1)
+void latency_gate_change(void);
+void latency_pwm_update(void);
+#endif
+#if (GOV_STATS==1)
+void gov_stats_update(int32 Speed, int32 Err);
+#endif
+#if (THROTTLE_LUT_CHECK==1)
+void throttle_lut_check(void);
+#endif
 
 void t0_int(void) { // Used for pwm control
 
@@ -751,25 +1202,10 @@ void t0_int_pwm_off(void) {
 void t0_int_pwm_off_damped(void) {
 	All_nFETs_off();
 	FET_DELAY(PFETON_DELAY);
-	A = Comm_Phase; // Turn on pfets according to commutation phase
-	A--;
-	//zz	jb	ACC.2, t0_int_pwm_off_comm_5_6
-	//zz	jb	ACC.1, t0_int_pwm_off_comm_3_4
-
-	CpFET_on(); // Comm phase 1 or 2 - turn on C
+	PFET_ON[Comm_Low](); // Turn on the low side phase pfet to damp (phases from COMM_TABLE)
 	t0_int_pwm_off_exit();
 } // t0_int_pwm_off_damped
 
-void t0_int_pwm_off_comm_3_4(void) {
-	BpFET_on(); // Comm phase 3 or 4 - turn on B
-	t0_int_pwm_off_exit();
-} // t0_int_pwm_off_comm_3_4
-
-void t0_int_pwm_off_comm_5_6(void) {
-	ApFET_on(); // Comm phase 5 or 6 - turn on A
-	t0_int_pwm_off_exit();
-} // t0_int_pwm_off_comm_5_6
-
 void t0_int_pwm_off_exit_nfets_off(void) { // Exit from pwm off cycle
 	TL1 = 0; // Reset timer1
 #if (MCU_50MHZ==1)
@@ -814,118 +1250,40 @@ void pwm_noBnFET_off(void) { // Dummy pwm on cycle
 	t0_int_pwm_on_exit();
 } // pwm_noBnFET_off
 
-void pwm_aBnFET_off(void) { // Pwm on cycle afet on (bfet off)
-	AnFET_on();
-	BnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_aBnFET_off
-
-void pwm_bBnFET_off(void) { // Pwm on cycle bfet on (cfet off)
-	BnFET_on();
-	CnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_bBnFET_off
-
-void pwm_cBnFET_off(void) { // Pwm on cycle cfet on (afet off)
-	CnFET_on();
-	AnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_cBnFET_off
-
-void pwm_anfet_bpBnFET_off(void) { // Pwm on cycle anfet on (bnfet off) and bpfet on (used in damped state 6)
-// Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-
-	ApFET_off();
-	CpFET_off();
-	FET_DELAY(NFETON_DELAY);
-	AnFET_on(); // Switch nFETs
-	BnFET_off();
+void pwm_nfet_on(void) { // Pwm on cycle low side nfet on (previous low side nfet off)
+	NFET_ON[Comm_Low]();
+	NFET_OFF[Comm_Prev_Low]();
 	t0_int_pwm_on_exit();
-} // pwm_anfet_bpBnFET_off
+} // pwm_nfet_on
 
-void pwm_anfet_cpBnFET_off(void) { // Pwm on cycle anfet on (bnfet off) and cpfet on (used in damped state 5)
+void pwm_nfet_on_damped(void) { // Pwm on cycle low side nfet on and damping pfets off
 // Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-	int32 d;
+	int32 Ph;
 
-	ApFET_off();
-	BpFET_off();
+	for (Ph = PH_A; Ph <= PH_C; Ph++)
+		if (Ph != Comm_High)
+			PFET_OFF[Ph]();
 	FET_DELAY(NFETON_DELAY);
-	AnFET_on(); // Switch nFETs
-	BnFET_off();
+	NFET_ON[Comm_Low](); // Switch nFETs
+	NFET_OFF[Comm_Prev_Low]();
 	t0_int_pwm_on_exit();
-} // pwm_anfet_cpBnFET_off
-
-void pwm_bnfet_cpBnFET_off(void) { // Pwm on cycle bnfet on (cnfet off) and cpfet on (used in damped state 4)
-// Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-	BpFET_off();
-	ApFET_off();
-	FET_DELAY(NFETON_DELAY);
-	BnFET_on(); // Switch nFETs
-	CnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_bnfet_cpBnFET_off
-
-void pwm_bnfet_apBnFET_off(void) { // Pwm on cycle bnfet on (cnfet off) and apfet on (used in damped state 3)
-// Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-	int32 d;
-
-	BpFET_off();
-	CpFET_off();
-	FET_DELAY(NFETON_DELAY);
-	BnFET_on(); // Switch nFETs
-	CnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_bnfet_apBnFET_off
-
-void pwm_cnfet_apBnFET_off(void) { // Pwm on cycle cnfet on (anfet off) and apfet on (used in damped state 2)
-// Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-
-	CpFET_off();
-	BpFET_off();
-	FET_DELAY(NFETON_DELAY);
-	CnFET_on(); // Switch nFETs
-	AnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_cnfet_apBnFET_off
-
-void pwm_cnfet_bpBnFET_off(void) { // Pwm on cycle cnfet on (anfet off) and bpfet on (used in damped state 1)
-// Delay from pFETs are turned off (only in damped mode) until nFET is turned on (pFETs are slow)
-
-	CpFET_off();
-	ApFET_off();
-	FET_DELAY(NFETON_DELAY);
-	CnFET_on(); // Switch nFETs
-	AnFET_off();
-	t0_int_pwm_on_exit();
-} // pwm_cnfet_bpBnFET_off
+} // pwm_nfet_on_damped
 
 void t0_int_pwm_on_exit_pfets_off(void) {
-	//zz	jnb	F.PGM_PWMOFF_DAMPED, t0_int_pwm_on_exit	// If not damped operation - branch
-	A = Comm_Phase; // Turn off pfets according to commutation phase
-	//zz	jb	ACC.2, t0_int_pfets_off_comm_4_5_6
-	//zz	jb	ACC.1, t0_int_pfets_off_comm_2_3
-} // t0_int_pwm_on_exit_pfets_off
+	int32 Ph;
 
-void t0_int_pfets_off_comm_1_6(void) {
-	ApFET_off(); // Comm phase 1 and 6 - turn off A and C
-	CpFET_off();
-	t0_int_pwm_on_exit();
-} // t0_int_pfets_off_comm_1_6
-
-void t0_int_pfets_off_comm_4_5_6(void) {
-	//zz	jb	ACC.1, t0_int_pfets_off_comm_1_6
-	ApFET_off(); // Comm phase 4 and 5 - turn off A and B
-	BpFET_off();
-	t0_int_pwm_on_exit();
-} // t0_int_pfets_off_comm_4_5_6
-
-void t0_int_pfets_off_comm_2_3(void) {
-	BpFET_off(); // Comm phase 2 and 3 - turn off B and C
-	CpFET_off();
+	//zz	jnb	F.PGM_PWMOFF_DAMPED, t0_int_pwm_on_exit	// If not damped operation - branch
+	for (Ph = PH_A; Ph <= PH_C; Ph++) // Turn off damping pfets (phases from COMM_TABLE)
+		if (Ph != Comm_High)
+			PFET_OFF[Ph]();
 	t0_int_pwm_on_exit();
-} // t0_int_pfets_off_comm_2_3
+} // t0_int_pwm_on_exit_pfets_off
 
 void t0_int_pwm_on_exit(void) {
+
+#if (THROTTLE_LATENCY==1)
+	latency_gate_change();
+#endif
 	/*
 	 // Set timer for coming on cycle length
 	 A =Current_Pwm_Limited;		// Load current pwm
@@ -963,6 +1321,362 @@ void t0_int_pwm_on_exit(void) {
 	 */
 } // t0_int_pwm_on_exit
 
+//___________________________________________________________________________
+//
+// RC pulse filter routines
+//
+// No assumptions
+// Single noise rejection stage for accepted RC pulses, selected by RCP_FILTER:
+// - Median of 3 removes any single pulse glitch. A genuine throttle step is
+//   delayed by exactly one pulse period
+// - Bounded slew passes changes up to RCP_FILTER_SLEW at once. Larger changes
+//   are held for up to RCP_FILTER_SLEW_HOLD pulses and then accepted, so a
+//   genuine large step is delayed by at most that many pulse periods
+// Pulses outside the legal PPM range are outliers. The previous value is held
+// until the leaky outlier count reaches RCP_OUTLIER_LIMIT, then the pulse is
+// set to zero. Wherever a pulse is forced (outlier limit or pulse timeout in
+// t2_int) rcp_filter_reset clears the history, so the first good pulse after
+// the fault is not the median of stale pre-fault pulses
+// Rcp_Glitch_Cnt counts rejected pulses and Rcp_Filter_Lag_Cnt counts pulses
+// by which genuine changes were delayed. A replaced pulse is classed as lag
+// when the next raw pulse confirms it
+//___________________________________________________________________________
+
+void rcp_filter_reset(void) {
+
+	Rcp_Filter_Raw[0] = Rcp_Filter_Raw[1] = Rcp_Filter_Out = RCP_MIN;
+	Rcp_Filter_Hold_Cnt = Rcp_Outlier_Cnt = 0;
+	Rcp_Filter_Subst_Raw = -1;
+
+} // rcp_filter_reset
+
+int32 rcp_filter(int32 Rcp) { // Interrupt context - must not use the TempN registers
+	int32 Out;
+#if (RCP_FILTER==1)
+	int32 Lo;
+#endif
+
+	if (Rcp_Outlier_Cnt > 0)
+		Rcp_Outlier_Cnt--;
+
+	if (Rcp_Filter_Subst_Raw >= 0) { // Classify the pulse replaced last time
+		if (Abs(Rcp - Rcp_Filter_Subst_Raw) <= RCP_FILTER_SLEW)
+			Rcp_Filter_Lag_Cnt++;
+		else
+			Rcp_Glitch_Cnt++;
+		Rcp_Filter_Subst_Raw = -1;
+	}
+
+#if (RCP_FILTER==1)	// Median of 3
+	if (Rcp_Filter_Raw[0] > Rcp_Filter_Raw[1]) {
+		Out = Rcp_Filter_Raw[0];
+		Lo = Rcp_Filter_Raw[1];
+	} else {
+		Out = Rcp_Filter_Raw[1];
+		Lo = Rcp_Filter_Raw[0];
+	}
+	if (Rcp < Out) // Out is now the larger of the history
+		Out = (Rcp > Lo) ? Rcp : Lo;
+	Rcp_Filter_Raw[0] = Rcp_Filter_Raw[1];
+	Rcp_Filter_Raw[1] = Rcp;
+#elif (RCP_FILTER==2)	// Bounded slew
+	Out = Rcp;
+	if ((Abs(Rcp - Rcp_Filter_Out) > RCP_FILTER_SLEW) && (Rcp_Filter_Hold_Cnt
+			< RCP_FILTER_SLEW_HOLD)) {
+		Out = Rcp_Filter_Out;
+		Rcp_Filter_Hold_Cnt++;
+	} else
+		Rcp_Filter_Hold_Cnt = 0;
+#else
+	Out = Rcp;
+#endif
+
+	if (Out != Rcp)
+		Rcp_Filter_Subst_Raw = Rcp;
+	Rcp_Filter_Out = Out;
+
+	return (Out);
+} // rcp_filter
+
+boolean rcp_filter_outlier(void) {
+
+	Rcp_Glitch_Cnt++;
+	Rcp_Outlier_Cnt++;
+	if (Rcp_Outlier_Cnt < RCP_OUTLIER_LIMIT)
+		return (true); // Hold previous value
+
+	rcp_filter_reset(); // Pulse is forced to RCP_MIN - drop the pre-fault history
+	return (false);
+} // rcp_filter_outlier
+
+//___________________________________________________________________________
+//
+// RC pulse setpoint routines
+//
+// No assumptions
+// apply_rcp_setpoint converts New_Rcp to Requested_Pwm, Current_Pwm and
+// Current_Pwm_Limited. It is called from pca_int as soon as a pulse is
+// measured, so throttle changes do not wait for the next 128us t2_int.
+// pca_int and t2_int mask each other, so the two callers do not overlap.
+// limit_current_pwm reapplies the pwm limits and is called every t2_int.
+// rcp_transfer is the reference pulse to pwm chain. It is only evaluated by
+// decode_throttle_transfer to fill Throttle_Lut, so the throttle curve costs
+// nothing per pulse.
+// Throttle curves: thrust is roughly proportional to pwm squared, so the
+// thrust linear curve uses sqrt(x) to give a constant plant gain. Expo uses x^2
+// for finer control around low throttle. Both are blended with linear by
+// P.Throttle_Curve_Amount
+//___________________________________________________________________________
+
+int32 isqrt(int32 x) {
+	int32 r, b;
+
+	r = 0;
+	for (b = 1L << 30; b != 0; b >>= 2)
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else
+			r >>= 1;
+
+	return (r);
+} // isqrt
+
+int32 throttle_curve(int32 Pwm) {
+	int32 Curve;
+
+	switch (P.Throttle_Curve) {
+	case 2: // Thrust linear
+		Curve = isqrt(Pwm * 255);
+		break;
+	case 3: // Expo
+		Curve = (Pwm * Pwm) / 255;
+		break;
+	default:
+		return (Pwm);
+	}
+
+	return (Pwm + ((Curve - Pwm) * Limit(P.Throttle_Curve_Amount, 0, 100)) / 100);
+} // throttle_curve
+
+void limit_current_pwm(void) { // Interrupt context - must not use the TempN registers
+#if (MODE >= 1)	// Tail or multi
+	int32 Pwm;
+
+	Pwm = Current_Pwm; // Default not limited
+	if (Current_Pwm >= Pwm_Limit)
+		Pwm = Pwm_Limit; // Limit pwm
+#if (MODE==MULTI_MODE)	// Multi
+	if (Pwm >= Pwm_Limit_Low_Rpm) // Limit pwm for low rpms
+		Pwm = Pwm_Limit_Low_Rpm;
+#endif
+	Current_Pwm_Limited = Pwm;
+#endif
+	if (Current_Pwm_Limited >= Pwm_Limit_Current) // Limit pwm for motor current
+		Current_Pwm_Limited = Pwm_Limit_Current;
+
+	if (Current_Pwm_Limited >= 0x40) // Set demag enabled if pwm is above 25%
+		F.DEMAG_ENABLED = true;
+
+} // limit_current_pwm
+
+int32 rcp_transfer(int32 Rcp, boolean Ppm) {
+	int32 Pwm;
+
+	Pwm = Rcp;
+
+	// Use a gain of 1.0625x for pwm input if not governor mode
+	if (!Ppm && Rcp_Gain_Enabled) {
+		if (Pwm > 240) // 240 = (255/1.0625) avoids wrap when scaled
+			Pwm = 240;
+		Pwm += Pwm >> 4; // Multiply by 1.0625
+
+		if (Rcp_Gain_Shift != 0) { // Adjust tail gain
+			if (Rcp_Gain_Pos) {
+				Pwm += Pwm >> Rcp_Gain_Shift;
+				if (Pwm > 0xff)
+					Pwm = 0xff;
+			} else
+				Pwm -= Pwm >> Rcp_Gain_Shift;
+		}
+	}
+
+	Pwm = throttle_curve(Pwm);
+
+#if (MODE==TAIL_MODE)	// Tail - limit minimum pwm
+	if (Pwm < Pwm_Motor_Idle)
+		Pwm = Pwm_Motor_Idle;
+#endif
+
+	return (Pwm);
+
+} // rcp_transfer
+
+void apply_rcp_setpoint(void) {
+
+	if (!F.RCP_MEAS_PWM_FREQ) // Do not clear flag while measuring pwm frequency
+		F.RCP_UPDATED = false; // Flag that pulse has been evaluated
+
+	Requested_Pwm = Throttle_Lut[F.RCP_PPM ? 1 : 0][New_Rcp];
+	if (F.STARTUP_PHASE) { // Limit pwm during direct start
+#if (MODE==MULTI_MODE)	// Multi
+		Requested_Pwm += 8; // Add an extra power boost during start
+		if (Requested_Pwm > 0xff)
+			Requested_Pwm = 0xff;
+#endif
+		if (Requested_Pwm >= Pwm_Limit)
+			Requested_Pwm = Pwm_Limit;
+	}
+
+#if (MODE==MAIN_MODE) || (MODE==MULTI_MODE)	// Main or multi
+	if (P.Gov_Mode == 4) // Governor mode sets current pwm itself
+#endif
+	{
+		Current_Pwm = Requested_Pwm; // Set equal as default
+		limit_current_pwm();
+	}
+
+#if (THROTTLE_LATENCY==1)
+	latency_pwm_update();
+#endif
+
+} // apply_rcp_setpoint
+
+//___________________________________________________________________________
+//
+// Decode throttle transfer
+//
+// No assumptions
+// Resolves mode, P.Motor_Gain and Pwm_Motor_Idle into Throttle_Lut, so the
+// pulse path is a single table load. Must be called again when any of
+// these change
+//___________________________________________________________________________
+
+void decode_throttle_transfer(void) {
+	int32 Rcp;
+
+#if (MODE==MAIN_MODE)	// Main - do not adjust gain
+	Rcp_Gain_Enabled = false;
+#elif (MODE==MULTI_MODE)	// Multi - only if not closed loop mode
+	Rcp_Gain_Enabled = (P.Gov_Mode == 4);
+#else
+	Rcp_Gain_Enabled = true;
+#endif
+
+	Rcp_Gain_Shift = 0; // Gain 3 is 1.00
+	Rcp_Gain_Pos = false;
+	if (P.Motor_Gain != 3) {
+		Rcp_Gain_Shift = (P.Motor_Gain & 0x01) ? 2 : 3; // "0.25" or "0.125"
+		Rcp_Gain_Pos = (P.Motor_Gain & 0x04) != 0;
+	}
+
+	for (Rcp = 0; Rcp <= RCP_MAX; Rcp++) {
+		Throttle_Lut[0][Rcp] = rcp_transfer(Rcp, false);
+		Throttle_Lut[1][Rcp] = rcp_transfer(Rcp, true);
+	}
+#if (THROTTLE_LUT_CHECK==1)
+	throttle_lut_check();
+#endif
+
+} // decode_throttle_transfer
+
+#if (THROTTLE_LUT_CHECK==1)
+
+//___________________________________________________________________________
+//
+// Throttle table check
+//
+// No assumptions
+// Builds a reference for every table entry from the original 8 bit t2_int
+// and pca_int code, without rcp_transfer, Rcp_Gain_Shift or
+// Ppm_Throttle_Gain: the 1.0625 gain as x + (x >> 4), the P.Motor_Gain bit
+// tests and the incrementing 8 bit throttle gain search, multiply and carry
+// out saturation. Throttle_Lut entries must match exactly. Ppm_Throttle_Lut
+// uses the 16 bit gain, so it may differ by up to THROTTLE_LUT_PPM_TOL; the
+// largest difference is kept in Throttle_Lut_Ppm_Diff. Entries outside these
+// bounds are counted in Throttle_Lut_Errors
+//___________________________________________________________________________
+
+int32 throttle_ref_pwm(int32 Rcp, boolean Ppm) {
+	int32 Pwm, Corr;
+	boolean Gain;
+
+#if (MODE==MAIN_MODE)	// Main - do not adjust gain
+	Gain = false;
+#elif (MODE==MULTI_MODE)	// Multi - only in open loop (P.Gov_Mode 4)
+	Gain = !Ppm && (P.Gov_Mode == 4);
+#else
+	Gain = !Ppm;
+#endif
+
+	Pwm = Rcp;
+	if (Gain) {
+		if (Pwm > 240) // 240 = (255/1.0625)
+			Pwm = 240;
+		Pwm += (Pwm >> 4) & 0x0f; // swap, anl #0Fh, add - multiply by 1.0625
+
+		if (P.Motor_Gain != 3) { // Gain 3 is 1.00
+			Corr = Pwm >> 2; // "0.25"
+			if ((P.Motor_Gain & 0x01) == 0)
+				Corr >>= 1; // "0.125"
+			if (P.Motor_Gain & 0x04) {
+				Pwm += Corr;
+				if (Pwm > 0xff) // Carry out
+					Pwm = 0xff;
+			} else
+				Pwm -= Corr;
+		}
+	}
+
+	Pwm = throttle_curve(Pwm);
+
+#if (MODE==TAIL_MODE)	// Tail - limit minimum pwm
+	if (Pwm < Pwm_Motor_Idle)
+		Pwm = Pwm_Motor_Idle;
+#endif
+
+	return (Pwm);
+
+} // throttle_ref_pwm
+
+void throttle_lut_check(void) {
+	int32 Rcp, Min, Max, Diff, Gain, Product, Ref, Err;
+
+	Min = P.Ppm_Min_Throttle;
+	Max = P.Ppm_Max_Throttle;
+	if (F.FULL_THROTTLE_RANGE) {
+		Min = 0;
+		Max = 255;
+	}
+	Diff = (Max - Min) & 0xff;
+	if (Diff < 130)
+		Diff = 130;
+
+	Gain = 0; // test_throttle_gain - unity gain is 128
+	do
+		Gain++;
+	while (((Diff * Gain) >> 8) < 128);
+
+	Throttle_Lut_Errors = Throttle_Lut_Ppm_Diff = 0;
+	for (Rcp = 0; Rcp <= RCP_MAX; Rcp++) {
+		Product = Rcp * Gain;
+		Ref = (Product & 0x8000) ? RCP_MAX : (Product >> 7); // rlc carry out
+		Err = Abs(Ppm_Throttle_Lut[Rcp] - Ref);
+		if (Err > Throttle_Lut_Ppm_Diff)
+			Throttle_Lut_Ppm_Diff = Err;
+		if (Err > THROTTLE_LUT_PPM_TOL)
+			Throttle_Lut_Errors++;
+
+		if (Throttle_Lut[0][Rcp] != throttle_ref_pwm(Rcp, false))
+			Throttle_Lut_Errors++;
+		if (Throttle_Lut[1][Rcp] != throttle_ref_pwm(Rcp, true))
+			Throttle_Lut_Errors++;
+	}
+
+} // throttle_lut_check
+
+#endif
+
 //___________________________________________________________________________
 //
 // Timer2 interrupt routine
@@ -1033,6 +1747,7 @@ void t2_int(void) { // Happens every 128us for low byte and every 32ms for high
 	 Rcp_Timeout_Cnt, #RCP_TIMEOUT	// For PWM, set timeout count to start value
 
 	 t2_int_ppm_timeout_set:
+	 rcp_filter_reset();			// Pulse is forced - drop the pre-fault filter history
 	 New_Rcp, Temp1				// Store new pulse length
 	 setb	F.RCP_UPDATED		 	// Set updated flag
 
@@ -1053,148 +1768,27 @@ void t2_int(void) { // Happens every 128us for low byte and every 32ms for high
 	 Rcp_Clear_Int_Flag 				// Clear interrupt flag
 
 	 t2_int_setpoint_update_start:
-	 // Process updated RC pulse
-	 jb	F.RCP_UPDATED, ($+5)	// Is there an updated RC pulse available?
-	 ajmp	t2_int_current_pwm_done		// No - update pwm limits and exit
-
-	 Temp1 = New_Rcp				// Load new pulse value
-	 jb	F.RCP_MEAS_PWM_FREQ, ($+5)	// If measure RCP pwm frequency flag set - do not clear flag
+	 // Until this is transliterated, timer2_tick_poll does the tick work below from main
+	 // Run the governor at a fixed rate
+	 djnz	Gov_Tick_Cnt, t2_int_gov_done
 
-	 clr	F.RCP_UPDATED		 	// Flag that pulse has been evaluated
+	 Gov_Tick_Cnt = GOV_TICKS;
+	 governor_update();			// Sets current pwm while governor is active
 
-	 // Use a gain of 1.0625x for pwm input if not governor mode
-	 jb	F.RCP_PPM, t2_int_pwm_min_run	// If flag is set (PPM) - branch
-
-	 #if (MODE==MAIN_MODE	// Main - do not adjust gain
-	 ajmp	t2_int_pwm_min_run
-	 #else
-
-	 #if (MODE==MULTI_MODE	// Multi
-	 Temp2 = #P.Gov_Mode		// Closed loop mode?
-	 cjne	@Temp2, #4, t2_int_pwm_min_run// Yes - branch
-	 #endif
-
-	 // Limit the maximum value to avoid wrap when scaled to pwm range
-	 C=0;
-	 A = Temp1
-	 subb	A, #240			// 240 = (255/1.0625) Needs to be updated according to multiplication factor below
-	 jc	t2_int_setpoint_update_mult
-
-	 A = #240			// Set requested pwm to max
-	 Temp1 = A
-
-	 t2_int_setpoint_update_mult:
-	 // Multiply by 1.0625 (optional adjustment gyro gain)
-	 A = Temp1
-	 swap	A			// After this "0.0625"
-	 anl	A, #0Fh
-	 add	A, Temp1
-	 Temp1 = A
-	 // Adjust tail gain
-	 Temp2 = #P.Motor_Gain
-	 cjne	@Temp2, #3, ($+5)			// Is gain 1?
-	 ajmp	t2_int_pwm_min_run			// Yes - skip adjustment
+	 t2_int_gov_done:
+	 current_limit_update();	// Sets Pwm_Limit_Current every tick, also when the motor is stalled
+	 // Pulses from pca_int are applied there. Only a pulse set by the pulses absent
+	 // check above (or a pulse during pwm frequency measurement) is still pending here
+	 jnb	F.RCP_UPDATED, t2_int_current_pwm_done	// Is there an updated RC pulse available?
 
-	 C=0;
-	 A/=2;			// After this "0.5"
-	 C=0;
-	 A/=2;			// After this "0.25"
-	 Bit_Access_Int, @Temp2				// (Temp2 has #P.Motor_Gain)
-	 jb	Bit_Access_Int.0, t2_int_setpoint_gain_corr	// Branch if bit 0 in gain is set
-
-	 C=0;
-	 A/=2;			// After this "0.125"
-
-	 t2_int_setpoint_gain_corr:
-	 jb	Bit_Access_Int.2, t2_int_setpoint_gain_pos	// Branch if bit 2 in gain is set
-
-	 C=0;
-	 xch	A, Temp1
-	 subb	A, Temp1					// Apply negative correction
-	 Temp1 = A
-	 ajmp	t2_int_pwm_min_run
-
-	 t2_int_setpoint_gain_pos:
-	 add	A, Temp1					// Apply positive correction
-	 Temp1 = A;
-	 jnc	t2_int_pwm_min_run			// Above max?
-
-	 A = #0xff					// Yes - limit
-	 Temp1 = A
-	 #endif
-
-	 t2_int_pwm_min_run:
-	 #if (MODE==TAIL_MODE	// Tail - limit minimum pwm
-	 // Limit minimum pwm
-	 C=0;
-	 A = Temp1;
-	 subb	A, Pwm_Motor_Idle			// Is requested pwm lower than minimum?
-	 jnc	t2_int_pwm_update			// No - branch
-
-	 A = Pwm_Motor_Idle			// Yes - limit pwm to Pwm_Motor_Idle
-	 Temp1 = A
-	 #endif
-
-	 t2_int_pwm_update:
-	 // Update requested_pwm
-	 Requested_Pwm= Temp1;		// Set requested pwm
-	 // Limit pwm during direct start
-	 jnb	F.STARTUP_PHASE, t2_int_current_pwm_update
-
-	 #if (MODE==MULTI_MODE)	// Multi
-	 A = Requested_Pwm;
-	 A+=8;					// Add an extra power boost during start
-	 Requested_Pwm= A;
-
-	 jnc	($+5)
-	 Requested_Pwm, #0xff
-	 #endif
-	 C=0;
-	 A = Requested_Pwm;			// Limit pwm during direct start
-	 A -=Pwm_Limit;
-	 jc	t2_int_current_pwm_update
-
-	 Requested_Pwm=Pwm_Limit;
-
-	 t2_int_current_pwm_update:
-	 #if (MODE==MAIN_MODE) || (MODE==MULTI_MODE)	// Main or multi
-	 Temp1 = P.Gov_Mode;		// Governor mode?
-	 cjne	@Temp1, #4, t2_int_pwm_exit	// Yes - branch
-	 #endif
-
-	 Current_Pwm= Requested_Pwm;	// Set equal as default
+	 apply_rcp_setpoint();		// Yes - set requested, current and limited pwm
+	 ajmp	t2_int_exit
 
 	 t2_int_current_pwm_done:
-	 #if (MODE >= 1)	// Tail or multi
-	 // Set current_pwm_limited
-	 Temp1 = Current_Pwm			// Default not limited
-	 C=0;
-	 A = Current_Pwm;				// Check against limit
-	 A-=Pwm_Limit;
-	 jc	($+4)					// If current pwm below limit - branch
-
-	 Temp1 = Pwm_Limit;			// Limit pwm
-
-	 #if (MODE==MULTI_MODE)	// Multi
-	 // Limit pwm for low rpms
-	 C=0;
-	 A = Temp1;					// Check against limit
-	 A-=Pwm_Limit_Low_Rpm;
-	 jc	($+4)					// If current pwm below limit - branch
-
-	 Temp1 = Pwm_Limit_Low_Rpm;		// Limit pwm
-
+	 limit_current_pwm();		// Pwm_Limit or Pwm_Limit_Low_Rpm may have changed
+	 #if (THROTTLE_LATENCY==1)
+	 latency_pwm_update();
 	 #endif
-	 Current_Pwm_Limited, Temp1
-	 #endif
-	 t2_int_pwm_exit:
-	 // Set demag enabled if pwm is above limit
-	 C=0;
-	 A = Current_Pwm_Limited;
-	 A-=0x40;					// Set if above 25%
-	 jc	($+4)
-
-	 setb	F.DEMAG_ENABLED
 
 	 t2_int_exit:
 	 // Check if high byte flag is set
@@ -1224,7 +1818,9 @@ void t2h_int(void) {
 	 Skip_T2h_Int, #1			// Skip next interrupt
 	 #endif
 	 // High byte interrupt (happens every 32ms)
+	 // Until this is transliterated, timer2_tick_poll calls check_temp_voltage_and_limit_power from main
 	 TF2H = 0;					// Clear interrupt flag
+	 check_temp_voltage_and_limit_power();	// Low voltage power limit
 	 Temp1 = GOV_SPOOLRATE;	// Load governor spool rate
 	 // Check RC pulse timeout counter (used here for PPM only)
 	 A = Rcp_Timeout_Cnt;			// RC pulse timeout count zero?
@@ -1734,16 +2330,13 @@ void t3_int(void) { // Used for commutation timing
  jnc	pca_int_ppm_check_full_range		// No - proceed
 
  pca_int_ppm_outside_range:
- inc	Rcp_Outside_Range_Cnt
- C=0;
- A = Rcp_Outside_Range_Cnt;
- A-=10;						// Allow a given number of outside pulses
- jnc	($+4)
- ajmp	pca_int_set_timeout				// If below limit - ignore pulse
+ inc	Rcp_Outside_Range_Cnt			// Counted for OneShot125 detection
+ A = rcp_filter_outlier();		// Let the RC pulse filter decide
+ jz	($+4)
+ ajmp	pca_int_set_timeout				// Held - ignore pulse
 
- New_Rcp=0;					// Set pulse length to zero
- setb	F.RCP_UPDATED		 		// Set updated flag
- ajmp	pca_int_set_timeout
+ Temp1 = #RCP_MIN				// Too many outliers - set pulse length to zero
+ ajmp	pca_int_filtered
 
  pca_int_ppm_check_full_range:
  A = Rcp_Outside_Range_Cnt;
@@ -1875,20 +2468,7 @@ void t3_int(void) { // Used for commutation timing
  }
 
  pca_int_ppm_max_checked:
- A = Temp5						// Multiply throttle value by gain
- B, Ppm_Throttle_Gain
- mul	AB
- xch	A, B
- C, B.7						// Multiply result by 2 (unity gain is 128)
- rlc	A
- Temp1 = A						// Transfer to Temp1/2
- Temp2 = #0
- jc	pca_int_ppm_limit_after_mult
-
- jmp	pca_int_limited
-
- pca_int_ppm_limit_after_mult:
- Temp1 = #RCP_MAX
+ Temp1 = Ppm_Throttle_Lut[Temp5]	// Apply throttle gain (built by find_throttle_gain)
  Temp2 = #0
  jmp	pca_int_limited
 
@@ -1932,8 +2512,16 @@ void t3_int(void) { // Used for commutation timing
 
  pca_int_limited:
  // RC pulse value accepted
+ jb	F.RCP_MEAS_PWM_FREQ, pca_int_filtered	// Do not filter during pwm frequency measurement
+ Temp1 = rcp_filter(Temp1);		// Filter glitches
+
+ pca_int_filtered:
  New_Rcp, Temp1				// Store new pulse length
  setb	F.RCP_UPDATED		 	// Set updated flag
+ #if (THROTTLE_LATENCY==1)
+ latency_rcp_edge();
+ #endif
+ apply_rcp_setpoint();			// Apply new pulse now rather than at the next t2_int
  jb	F.RCP_MEAS_PWM_FREQ, ($+5)	// Is measure RCP pwm frequency flag set?
 
  ajmp	pca_int_set_timeout			// No - skip measurements
@@ -2195,229 +2783,174 @@ void mult_s16_by_u8_div_16(void) {
 
 //___________________________________________________________________________
 //
-// Calculate governor routines
+// Governor routines
 //
 // No assumptions
 //
 // Governs headspeed based upon the Comm_Period4x variable and pwm
-// The governor task is split into several routines in order to distribute processing time
-//
+// governor_update is called every GOV_TICKS timer2 ticks (from
+// timer2_tick_poll until t2_int is transliterated), so the loop rate does not
+// depend on motor speed. Speed and target are in 100 eRPM units
+// and the controller state has GOV_Q fractional pwm bits. The integral is held
+// while the output is saturated in the direction of the error (anti-windup).
+// D acts on the measured speed, so target steps do not kick the output.
+// Gains are interpolated from the schedule at Gov_Target and Current_Pwm.
+// Feed forward is the duty for Gov_Target at the present supply voltage,
+// Gov_Target * Gov_Volt_Comp / Gov_Speed_Per_Pwm, plus Gov_Load_Input. Speed
+// per pwm step is learned while the governor runs, normalised to
+// Lipo_Adc_Reference, so a sagging battery raises the feed forward at once
 //___________________________________________________________________________
-// First governor routine - calculate governor target
-
-void calc_governor_int_error(void) {
 
-} // calc_governor_int_error
+#if (MODE==MAIN_MODE) || (MODE==MULTI_MODE)	// Main or multi
+int32 governor_target_speed(int32 Range) {
+	int32 Inv, Period;
+
+	Inv = 255 - Governor_Req_Pwm;
+	switch (Range) { // Comm_Period4x target for governor requested pwm
+	case 1: // High range - 1.5 + 4*((255-pwm)/256)
+		Period = 0x180 + Inv * 4;
+		break;
+	case 2: // Middle range - 2 + 8*((255-pwm)/256)
+		Period = 0x200 + Inv * 8;
+		break;
+	default: // Low range - 3.5 + 16*((255-pwm)/256)
+		Period = 0x380 + Inv * 16;
+		break;
+	}
+	return (GOV_SPEED_K / Period);
 
-#if (MODE==MAIN_MODE)	// Main
-void calc_governor_target(void) {
+} // governor_target_speed
 
-	Temp1 = P.Gov_Mode; // Governor mode?
-	cjne @Temp1, 4, governor_speed_check // Yes
-	jmp calc_governor_target_exit // No
+int32 governor_sched_gain(int32 *Sched, int32 Speed, int32 Pwm) {
+	int32 s, p, i, G0, G1;
 
-	governor_speed_check:
-	// Stop governor for stop RC pulse
+	Speed = Limit(Speed, 0, ((GOV_SCHED_SPEEDS - 1) << GOV_SCHED_SPEED_SHIFT) - 1);
+	Pwm = Limit(Pwm, 0, ((GOV_SCHED_PWMS - 1) << GOV_SCHED_PWM_SHIFT) - 1);
+	s = Speed >> GOV_SCHED_SPEED_SHIFT;
+	p = Pwm >> GOV_SCHED_PWM_SHIFT;
+	Speed -= s << GOV_SCHED_SPEED_SHIFT;
+	Pwm -= p << GOV_SCHED_PWM_SHIFT;
 
-	if (New_Rcp < (RCP_MAX/10)) { // Yes - deactivate
+	i = s * GOV_SCHED_PWMS + p;
+	G0 = Sched[i] + (((Sched[i + 1] - Sched[i]) * Pwm) >> GOV_SCHED_PWM_SHIFT);
+	i += GOV_SCHED_PWMS;
+	G1 = Sched[i] + (((Sched[i + 1] - Sched[i]) * Pwm) >> GOV_SCHED_PWM_SHIFT);
 
-		if (!(F.STARTUP_PHASE || F.INITIAL_RUN_PHASE)) {// Deactivate if any startup phase set
+	return (G0 + (((G1 - G0) * Speed) >> GOV_SCHED_SPEED_SHIFT));
 
-			// Skip speed check if governor is already active
-			A = Gov_Active;
-			jnz governor_target_calc
+} // governor_sched_gain
 
-			// Check speed (do not run governor for low speeds)
-			Temp1 =0x05; // Default high range activation limit value (~62500 eRPM)
-			Temp2 = P.Gov_Range;
-			A = @Temp2; // Check if high range (Temp2 has #P.Gov_Range)
-			A--;
-			jz governor_act_lim_set // If high range - branch
+int32 governor_feed_forward(int32 Speed) {
+	int32 FF, Kv;
 
-			Temp1 =0x0A; // Middle range activation limit value (~31250 eRPM)
-			A--;
-			jz governor_act_lim_set // If middle range - branch
+	Gov_Volt_Comp = 0x100;
+	if ((Lipo_Adc_Value > 0) && (Lipo_Adc_Reference > 0))
+		Gov_Volt_Comp = Limit((Lipo_Adc_Reference << 8) / Lipo_Adc_Value,
+				GOV_VOLT_COMP_MIN, GOV_VOLT_COMP_MAX);
 
-			Temp1 = 0x12; // Low range activation limit value (~17400 eRPM)
-			governor_act_lim_set:
-			C=0;
-			A = Comm_Period4x;
-			A-= Temp1;
-			jc governor_activate // If speed above min limit  - run governor
-		}
+	if (Current_Pwm >= GOV_FF_LEARN_PWM) { // Speed ~ pwm * voltage
+		Kv = (Speed * Gov_Volt_Comp) / Current_Pwm;
+		if (Gov_Speed_Per_Pwm == 0)
+			Gov_Speed_Per_Pwm = Kv;
+		else
+			Gov_Speed_Per_Pwm += (Kv - Gov_Speed_Per_Pwm) >> GOV_FF_LEARN_SHIFT;
 	}
 
-	governor_deactivate:
-	A = Gov_Active;
-	jz governor_first_deactivate_done// This code is executed continuously. Only execute the code below the first time
-
-	Pwm_Limit_Spoolup = Pwm_Spoolup_Beg;
-	Spoolup_Limit_Cnt=255;
-	Spoolup_Limit_Skip=1;
-
-	governor_first_deactivate_done:
-	Current_Pwm, Requested_Pwm // Set current pwm to requested
-
-	Gov_Integral= Gov_Integral_X= 0;
-	Gov_Active= false;
-	jmp calc_governor_target_exit
-
-	governor_activate:
-	Gov_Active=1;
-
-	governor_target_calc:
-	// Governor calculations
-	Temp2 = P.Gov_Range;
-	A = Temp2; // Check high, middle or low range
-	A--;
-	jnz calc_governor_target_middle
-
-	A = Governor_Req_Pwm // Load governor requested pwm
-	cpl A; // Calculate 255-pwm (invert pwm)
-	// Calculate comm period target (1 + 2*((255-Requested_Pwm)/256) - 0.25)
-	rlc A; // Msb to carry
-	rlc A; // To bit0
-	Temp2 = A; // Now 1 lsb is valid for H
-	rrc A
-	Temp1 = A; // Now 7 msbs are valid for L
-	A = Temp2
-	anl A,0x01; // Calculate H byte
-	A++; // Add 1
-	Temp2 = A;
-	A = Temp1;
-	anl A,0x0FE; // Calculate L byte
-	jmp calc_governor_subtract_025
-
-	calc_governor_target_middle:
-	A = Temp2 // Check middle or low range (Temp2 has #P.Gov_Range)
-	dec A
-	dec A
-	jnz calc_governor_target_low
-
-	A = Governor_Req_Pwm // Load governor requested pwm
-	cpl A // Calculate 255-pwm (invert pwm)
-	// Calculate comm period target (1 + 4*((255-Requested_Pwm)/256))
-	rlc A // Msb to carry
-	rlc A // To bit0
-	rlc A // To bit1
-	Temp2 = A // Now 2 lsbs are valid for H
-	rrc A
-	Temp1 = A // Now 6 msbs are valid for L
-	A = Temp2
-	anl A, 0x03; // Calculate H byte
-	inc A // Add 1
-	Temp2 = A
-	A = Temp1
-	anl A,0xFC // Calculate L byte
-	jmp calc_governor_store_target
-
-	calc_governor_target_low:
-	A = Governor_Req_Pwm // Load governor requested pwm
-	cpl A // Calculate 255-pwm (invert pwm)
-	// Calculate comm period target (2 + 8*((255-Requested_Pwm)/256) - 0.25)
-	rlc A // Msb to carry
-	rlc A // To bit0
-	rlc A // To bit1
-	rlc A // To bit2
-	Temp2 = A // Now 3 lsbs are valid for H
-	rrc A
-	Temp1 = A // Now 5 msbs are valid for L
-	A = Temp2
-	anl A, 0x07; // Calculate H byte
-	inc A // Add 1
-	inc A // Add 1 more
-	Temp2 = A;
-	A = Temp1;
-	anl A, 0xF8; // Calculate L byte
-	calc_governor_subtract_025:
-	C=0;
-	subb A, 0x40; // Subtract 0.25
-	Temp1 = A;
-	A = Temp2;
-	A-=0;
-
-	Temp2 = A
-	calc_governor_store_target:
-	// Store governor target
-	Gov_Target= Temp1;
-	Gov_Target_H, Temp2;
-	calc_governor_target_exit:
-}
+	FF = 0;
+	if (Gov_Speed_Per_Pwm > 0)
+		FF = Limit(((Gov_Target * Gov_Volt_Comp) << 8) / Gov_Speed_Per_Pwm, 0, 255 << 8);
+	FF = (FF * Gov_FF_Gain) >> 8;
 
-#elif (MODE==TAIL_MODE)	// Tail
-void calc_governor_target() {}
+	return ((FF + (Gov_Load_Input << 8)) << (GOV_Q - 8));
+
+} // governor_feed_forward
 
-#elif (MODE==MULTI_MODE)	// Multi
 void governor_deactivate(void) {
 
+#if (MODE==MAIN_MODE)	// Main
+	if (Gov_Active) { // First time only
+		Pwm_Limit_Spoolup = Pwm_Spoolup_Beg;
+		Spoolup_Limit_Cnt = 255;
+		Spoolup_Limit_Skip = 1;
+	}
+#endif
 	Current_Pwm = Requested_Pwm; // Set current pwm to requested
+	limit_current_pwm();
 
-	Gov_Target = Gov_Integral = Gov_Integral_X = 0;
+	Gov_Integral = Gov_Proportional = Gov_Derivative = 0;
 	Gov_Active = false;
-	//zzcalc_governor_target_exit();
 
 } // governor_deactivate
 
-void governor_activate(void) {
-
-	Gov_Active = P.Gov_Mode != 0;
-
-	Governor_Req_Pwm = Requested_Pwm;
-	Comm_Period4x = (51000L / Requested_Pwm) * 2;
-
-} // governor_activate
-
-void calc_governor_target(void) {
-
-	if (P.Gov_Mode)
-		governor_activate();
-	else {
-		if (New_Rcp < RCP_STOP) // Is pulse below stop value?
-			governor_deactivate(); // Yes - deactivate
-	}
-} // calc_governor_target
+void governor_update(void) { // Interrupt context - must not use the TempN registers
+	int32 Range, Speed, Err, Change, FF, Out;
+	boolean Saturated;
 
+	if (P.Gov_Mode == 4) // Off
+		return;
 
+#if (MODE==MAIN_MODE)	// Main
+	Range = Limit(P.Gov_Range, 1, 3);
+#else
+	Range = Limit(P.Gov_Mode, 1, 3);
+	Governor_Req_Pwm = Requested_Pwm; // No spoolup in multi
 #endif
 
-// Second governor routine - calculate governor proportional error
-void calc_governor_prop_error(void) {
-
-	// Exit if governor is inactive
-	if (Gov_Active) {
-
-#if ((MODE==MAIN_MODE)|| (MODE==TAIL_MODE))	// Main or tail
-		Gov_Proportional = (Comm_Period4x>>1) - Gov_Target;
-#elif (MODE==MULTI_MODE)	// Multi
-		Gov_Proportional = Governor_Req_Pwm - Gov_Target;
+#if (MODE==MAIN_MODE)	// Main - stop governor below 10% throttle
+	if ((New_Rcp < (RCP_MAX/10)) || F.STARTUP_PHASE || F.INITIAL_RUN_PHASE
+#else
+	if ((New_Rcp < RCP_STOP) || F.STARTUP_PHASE || F.INITIAL_RUN_PHASE
 #endif
-
-		Gov_Integral_X += Gov_Proportional;
-		Gov_Integral_X = Limit1(Gov_Integral_X, 127); // 0x00f0??
-
-		Current_Pwm = Limit1(Current_Pwm, Pwm_Limit);
-
+			|| (Comm_Period4x == 0)) {
+		governor_deactivate();
+		return;
 	}
 
-} // calc_governor_prop_error
-
-// Fourth governor routine - calculate governor proportional correction
-void calc_governor_prop_correction(void) {
+	Speed = GOV_SPEED_K / Comm_Period4x;
+	Gov_Target = governor_target_speed(Range);
 
-	if (Gov_Active) {
-		Gov_Proportional = (P.Gov_P_Gain * Gov_Proportional) / 16;
-		Gov_Proportional = Limit1(Gov_Proportional, 127);
+	if (!Gov_Active) { // Do not run governor for low speeds
+		if (Comm_Period4x >= GOV_ACT_PERIOD[Range - 1]) {
+			governor_deactivate();
+			return;
+		}
+		Gov_Active = true;
+		FF = governor_feed_forward(Speed);
+		Gov_Integral = (Current_Pwm << GOV_Q) - FF; // Start from the present pwm
+		Gov_Prev_Speed = Speed;
+	} else
+		FF = governor_feed_forward(Speed);
+	Err = Limit1(Gov_Target - Speed, GOV_ERR_MAX);
+	Change = Limit1(Gov_Prev_Speed - Speed, GOV_ERR_MAX);
+	Gov_Prev_Speed = Speed;
+
+	Gov_Proportional = Limit1((Err * governor_sched_gain(Gov_P_Sched,
+			Gov_Target, Current_Pwm)) << GOV_P_SHIFT, 255 << GOV_Q);
+	Gov_Derivative = Limit1((Change * governor_sched_gain(Gov_D_Sched,
+			Gov_Target, Current_Pwm)) << GOV_D_SHIFT, 255 << GOV_Q);
+
+	Out = FF + Gov_Proportional + Gov_Integral + Gov_Derivative;
+	Current_Pwm = Limit(Out >> GOV_Q, 0, 255);
+	limit_current_pwm();
+
+	Saturated = ((Err > 0) && (Current_Pwm_Limited < (Out >> GOV_Q)))
+			|| ((Err < 0) && (Out < 0));
+	if (!Saturated) {
+		Gov_Integral += (Err * governor_sched_gain(Gov_I_Sched, Gov_Target,
+				Current_Pwm)) << GOV_I_SHIFT;
+		Gov_Integral = Limit1(Gov_Integral, 255 << GOV_Q);
 	}
-}
 
-// Fifth governor routine - calculate governor integral correction
-void calc_governor_int_correction(void) {
+#if (GOV_STATS==1)
+	gov_stats_update(Speed, Err);
+#endif
 
-	if (Gov_Active) {
-		Gov_Integral = (P.Gov_I_Gain * Gov_Integral) / 16;
-		Gov_Integral = Limit1(Gov_Integral, 127);
-	}
-} // calc_governor_int_correction
+} // governor_update
+
+#elif (MODE==TAIL_MODE)	// Tail
+void governor_update(void) {
+} // governor_update
+#endif
 
 //___________________________________________________________________________
 //
@@ -2470,59 +3003,331 @@ void set_pwm_limit_low_rpm(void) {
 
 	 Temp1 = Pwm_Spoolup_Beg
 
-	 set_pwm_limit_low_rpm_exit:
-	 Pwm_Limit_Low_Rpm, Temp1
-	 */
-}
+	 set_pwm_limit_low_rpm_exit:
+	 Pwm_Limit_Low_Rpm, Temp1
+	 */
+}
+
+//___________________________________________________________________________
+//
+// Measure lipo cells
+//
+// No assumptions
+// Measure voltage and calculate lipo cells. Sets the low voltage limit from
+// P.Low_Voltage_Lim and takes the voltage at arming as Lipo_Adc_Reference
+//___________________________________________________________________________
+
+int32 adc_voltage_decimate(void) { // Interrupt context - must not use the TempN registers
+	int32 i, Sum;
+
+	Sum = 0;
+	for (i = 0; i < ADC_DMA_SAMPLES; i++)
+		Sum += Adc_Dma_Buf[i];
+
+	return (Sum >> ADC_DECIMATE_SHIFT);
+
+} // adc_voltage_decimate
+
+void measure_lipo_cells(void) {
+#if (MODE!=TAIL_MODE)	// Main or multi
+	int32 Mv;
+
+	Delay1mS(2); // Let the dma buffer fill
+	Lipo_Adc_Reference = Lipo_Adc_Value = adc_voltage_decimate(); // Supply voltage at arming
+
+	Mv = (Lipo_Adc_Value * ADC_MV_Q8) >> 8;
+	Lipo_Cells = (Mv + LIPO_CELL_MAX_MV - 1) / LIPO_CELL_MAX_MV;
+
+	Lipo_Adc_Limit = 0; // Off
+	if ((P.Low_Voltage_Lim >= 2) && (P.Low_Voltage_Lim <= 6)) // 3.0V to 3.4V per cell
+		Lipo_Adc_Limit = ((Lipo_Cells * (2800 + P.Low_Voltage_Lim * 100)) << 8)
+				/ ADC_MV_Q8;
+#endif
+
+} // measure_lipo_cells
+
+//___________________________________________________________________________
+//
+// Start ADC conversion
+//
+// No assumptions
+// Starts continuous conversion used for measuring power supply voltage. The
+// adc runs freely into a circular dma buffer, which is decimated when read,
+// so no conversion work is left in the commutation loop
+//___________________________________________________________________________
+void start_adc_conversion(void) {
+
+	Adc_Start_Dma(Adc_Dma_Buf, ADC_DMA_SAMPLES);
+
+} // start_adc_conversion
+
+//___________________________________________________________________________
+//
+// Thermal model update
+//
+// No assumptions
+// First order thermal model of the FETs, driven by the estimated dissipation.
+// Conduction loss is taken from the sensed current when available, otherwise
+// estimated from pwm, plus a switching loss proportional to eRPM. The model
+// state follows the loss estimate only. While power is applied, the residual
+// against the sensor trains Therm_Gain, the scale of the loss estimate, so a
+// model running hot or cold is corrected through its inputs. At idle the
+// model and the ambient estimate settle slowly onto the sensor instead.
+// Pwm_Limit_Temp derates over a band below TEMP_LIMIT_C using the
+// temperature a few seconds ahead, so power is eased off before the limit
+// rather than cut at it
+//___________________________________________________________________________
+
+void thermal_model_update(void) { // Interrupt context - must not use the TempN registers
+	int32 Amps32, Steady, Residual, Predicted, Band, Target;
+
+	Current_Average_Temp = Board_Temp_Read();
+
+	if (!Therm_Init) { // First update - start from the sensor
+		Therm_Model = Therm_Ambient = Current_Average_Temp << 8;
+		Therm_Init = true;
+	}
+
+	if (Current_Ma > 0) {
+		Amps32 = Current_Ma >> 5;
+		Therm_Power_Mw = (Amps32 * Amps32 * THERM_RDS_MOHM) >> 10;
+	} else
+		Therm_Power_Mw = (THERM_EST_MW * Current_Pwm_Limited * Current_Pwm_Limited) >> 16;
+	if ((Comm_Period4x > 0) && (Current_Pwm_Limited > 0))
+		Therm_Power_Mw += (80000 / Comm_Period4x) * THERM_COMM_MW_PER_KERPM;
+
+	Therm_Power_Mw = (Therm_Power_Mw * Therm_Gain) >> 8;
+
+	Steady = Therm_Ambient + ((Therm_Power_Mw * THERM_RTH_CW) << 8) / 1000;
+	Therm_Model += (Steady - Therm_Model) >> THERM_TAU_SHIFT;
+	Residual = (Current_Average_Temp << 8) - Therm_Model;
+	if (Current_Pwm_Limited == 0) { // Idle - sensor settles towards ambient
+		Therm_Ambient += ((Current_Average_Temp << 8) - Therm_Ambient) >> THERM_TAU_SHIFT;
+		Therm_Model += Residual >> THERM_TAU_SHIFT;
+	} else
+		Therm_Gain = Limit(Therm_Gain + (Residual >> THERM_GAIN_SHIFT),
+				THERM_GAIN_MIN, THERM_GAIN_MAX);
+
+	Predicted = Therm_Model + ((Steady - Therm_Model) >> THERM_PREDICT_SHIFT);
+	Band = (Predicted >> 8) - (TEMP_LIMIT_C - THERM_DERATE_BAND_C);
+
+	Target = 0xff;
+	if (P.Temp_Prot_Enable == 1) {
+		if (Band >= THERM_DERATE_BAND_C)
+			Target = PWM_LIMIT_TEMP_MIN;
+		else if (Band > 0)
+			Target = 0xff - ((0xff - PWM_LIMIT_TEMP_MIN) * Band) / THERM_DERATE_BAND_C;
+	}
+
+	if (Pwm_Limit_Temp > Target) // Ramp by one step per update
+		Pwm_Limit_Temp--;
+	else if (Pwm_Limit_Temp < Target)
+		Pwm_Limit_Temp++;
+
+} // thermal_model_update
+
+//___________________________________________________________________________
+//
+// Check temperature, power supply voltage and limit power
+//
+// No assumptions
+// Used to limit main motor power in order to maintain the required voltage.
+// Called every 32ms from t2h_int (from timer2_tick_poll until t2h_int is
+// transliterated). Pwm_Limit_Voltage steps down while the supply is below
+// Lipo_Adc_Limit and back up once it recovers past the hysteresis. The lower
+// of it and Pwm_Limit_Temp is applied to Pwm_Limit once the startup phases
+// are over
+//___________________________________________________________________________
+
+void check_temp_voltage_and_limit_power(void) { // Interrupt context - must not use the TempN registers
+
+	Lipo_Adc_Value = adc_voltage_decimate();
+
+	if (Lipo_Adc_Limit != 0) {
+		if (Lipo_Adc_Value < Lipo_Adc_Limit) {
+			if (Pwm_Limit_Voltage > PWM_LIMIT_VOLT_MIN)
+				Pwm_Limit_Voltage--;
+		} else if (Lipo_Adc_Value
+				>= (Lipo_Adc_Limit + (Lipo_Adc_Limit >> VOLT_LIMIT_HYST_SHIFT))) {
+			if (Pwm_Limit_Voltage < 0xff)
+				Pwm_Limit_Voltage++;
+		}
+	} else
+		Pwm_Limit_Voltage = 0xff;
+
+	thermal_model_update();
+
+	if (!(F.STARTUP_PHASE || F.INITIAL_RUN_PHASE)) {
+		Pwm_Limit = (Pwm_Limit_Temp < Pwm_Limit_Voltage) ? Pwm_Limit_Temp : Pwm_Limit_Voltage;
+#if (MODE==MAIN_MODE)	// Main - the soft spoolup limit still applies
+		if (Pwm_Limit > Pwm_Limit_Spoolup)
+			Pwm_Limit = Pwm_Limit_Spoolup;
+#endif
+	}
+
+} // check_temp_voltage_and_limit_power
+
+void check_voltage_start(void) {
+
+	// Check initial voltage and set the voltage pwm limit accordingly
+	Lipo_Adc_Value = adc_voltage_decimate();
+	Pwm_Limit_Voltage = 0xff;
+	if ((Lipo_Adc_Limit != 0) && (Lipo_Adc_Value < Lipo_Adc_Limit))
+		Pwm_Limit_Voltage = PWM_LIMIT_VOLT_MIN;
+
+} // check_voltage_start
 
 //___________________________________________________________________________
 //
-// Measure lipo cells
+// Current limit update
 //
 // No assumptions
-// Measure voltage and calculate lipo cells
+// Called every timer2 tick (128us) from t2_int, or from timer2_tick_poll
+// until t2_int is transliterated, so it keeps acting when a prop strike or
+// stall stops commutation. Over the limit, Pwm_Limit_Current is cut from
+// the applied pwm in proportion to the excess, then raised one step per tick
+// while the current stays below the limit. limit_current_pwm applies it
 //___________________________________________________________________________
 
-void measure_lipo_cells(void) {
+void current_limit_update(void) { // Interrupt context - must not use the TempN registers
+	int32 Excess, Pwm;
 
-#if (MODE!=TAIL_MODE)	// Tail
-#endif
+	Current_Ma = (Adc_Current_Read() - CURRENT_ADC_OFFSET) * CURRENT_MA_PER_COUNT;
 
-} // measure_lipo_cells
+	if (Current_Ma > 0) {
+		Charge_Ma_Ticks += Current_Ma;
+		if (Charge_Ma_Ticks >= MAH_MA_TICKS) {
+			Charge_Ma_Ticks -= MAH_MA_TICKS;
+			Consumed_Mah++;
+		}
+	}
+
+	if (P.Current_Limit == 0) {
+		Pwm_Limit_Current = 0xff;
+		return;
+	}
+
+	Excess = Current_Ma - (P.Current_Limit * 1000);
+	if (Excess > 0) {
+		Pwm = Current_Pwm_Limited - (Excess >> CURRENT_CUT_SHIFT) - 1;
+		if (Pwm < Pwm_Limit_Current)
+			Pwm_Limit_Current = Limit(Pwm, PWM_LIMIT_CURRENT_MIN, 0xff);
+	} else if (Pwm_Limit_Current < 0xff)
+		Pwm_Limit_Current++;
+
+} // current_limit_update
 
 //___________________________________________________________________________
 //
-// Start ADC conversion
+// Timer2 tick poll
 //
 // No assumptions
-// Start conversion used for measuring power supply voltage
+// t2_int and t2h_int are still pseudo code, so their tick work does not run
+// in the compiled tree. timer2_tick_poll is called from the main loop and
+// runs it once per elapsed timer2 tick of T2_TICK_CYCLES. At most
+// T2_TICKS_MAX ticks are caught up after a long main loop pass. Remove it
+// once the timer2 interrupts are transliterated
 //___________________________________________________________________________
-void start_adc_conversion(void) {
 
-	// Start adc dma burst then stop to prevent traffic interference
+void timer2_tick_poll(void) {
+	uint32 Ticks;
 
-} // start_adc_conversion
+	Ticks = (Cycle_Count() - T2_Tick_Start) / T2_TICK_CYCLES;
+	if (Ticks > T2_TICKS_MAX) { // Drop the older ticks
+		T2_Tick_Start += (Ticks - T2_TICKS_MAX) * T2_TICK_CYCLES;
+		Ticks = T2_TICKS_MAX;
+	}
+
+	while (Ticks-- > 0) {
+		T2_Tick_Start += T2_TICK_CYCLES;
+
+		if (--Gov_Tick_Cnt <= 0) { // Run the governor at a fixed rate
+			Gov_Tick_Cnt = GOV_TICKS;
+			governor_update(); // Sets current pwm while governor is active
+		}
+		current_limit_update(); // Sets Pwm_Limit_Current every tick
+		limit_current_pwm(); // Pwm_Limit_Current, Pwm_Limit or Pwm_Limit_Low_Rpm may have changed
+
+		if (--T2h_Tick_Cnt <= 0) { // t2h_int work every 32ms
+			T2h_Tick_Cnt = T2H_TICKS;
+			check_temp_voltage_and_limit_power(); // Voltage and temperature power limits
+		}
+	}
+
+} // timer2_tick_poll
 
 //___________________________________________________________________________
 //
-// Check temperature, power supply voltage and limit power
+// Telemetry routines
 //
 // No assumptions
-// Used to limit main motor power in order to maintain the required voltage
+// Sends a KISS telemetry frame on request. All values are big endian:
+//   0     temperature (degC)
+//   1-2   voltage (10mV)
+//   3-4   current (10mA)
+//   5-6   consumption (mAh)
+//   7-8   eRPM/100
+//   9     CRC8 (poly 0x07) of bytes 0-8
+// telem_step is called while waiting from zero cross to commutation, and every
+// 1ms while waiting for power on. Each call does one small step (take a
+// snapshot, or CRC and send one byte), so the frame is spread over several
+// commutation steps and no step is extended
 //___________________________________________________________________________
 
-void check_temp_voltage_and_limit_power(void) {
+uint8 telem_crc8(uint8 Crc, uint8 b) {
+	int32 i;
 
-	//is routine reduces pwmLimit as battery sags or temperature rises to high
+	Crc ^= b;
+	for (i = 0; i < 8; i++)
+		Crc = (Crc & 0x80) ? (Crc << 1) ^ 0x07 : (Crc << 1);
 
-} // check_temp_voltage_and_limit_power
+	return (Crc);
 
-void check_voltage_start(void) {
+} // telem_crc8
 
-	//cck initial voltage and set pwmLimit accordingly
+void telem_put16(int32 Pos, int32 v) {
 
+	v = Limit(v, 0, 0xffff);
+	Telem_Frame[Pos] = v >> 8;
+	Telem_Frame[Pos + 1] = v;
 
-} // check_voltage_start
+} // telem_put16
+
+void telem_snapshot(void) {
+#if (TELEM_PHASE_CORR==1)
+	int32 s;
+#endif
+
+	Telem_Frame[0] = Limit(Current_Average_Temp, 0, 255);
+	telem_put16(1, ((Lipo_Adc_Value * ADC_MV_Q8) >> 8) / 10);
+	telem_put16(3, Current_Ma / 10);
+	telem_put16(5, Consumed_Mah);
+	telem_put16(7, (F.MOTOR_SPINNING && (Comm_Period4x > 0)) ? 800000 / Comm_Period4x : 0);
+#if (TELEM_PHASE_CORR==1)
+	for (s = 0; s < PHASE_STEPS; s++) // 1/8deg is 1920 * counts / Comm_Period4x
+		Telem_Frame[9 + s] = (Comm_Period4x > 0) ?
+				Limit1(((Phase_Corr[s] >> 8) * 1920) / Comm_Period4x, 127) : 0;
+#endif
+
+	Telem_Crc = 0;
+	Telem_Pos = 0;
+
+} // telem_snapshot
+
+void telem_step(void) {
+
+	if (Telem_Pos >= TELEM_FRAME_SIZE) { // Idle
+		if (Telem_Requested())
+			telem_snapshot();
+	} else {
+		if (Telem_Pos == (TELEM_FRAME_SIZE - 1))
+			Telem_Frame[Telem_Pos] = Telem_Crc;
+		else
+			Telem_Crc = telem_crc8(Telem_Crc, Telem_Frame[Telem_Pos]);
+		Telem_Uart_Tx(Telem_Frame[Telem_Pos++]);
+	}
+
+} // telem_step
 
 //___________________________________________________________________________
 //
@@ -2550,8 +3355,122 @@ void set_startup_pwm(void) {
 
 void initialize_all_timings(void) {
 	Comm_Period4x = 0x7F00;// Set commutation period registers
+	Trk_Period = Trk_Rate = Zc_Jitter = 0;
+	phase_corr_reset();
 }
 
+//___________________________________________________________________________
+//
+// Commutation period tracker
+//
+// No assumptions
+// Alpha-beta tracker of step time and its change per step, run alongside the
+// Comm_Period4x average. comm_tracker_update takes each new step time from
+// calc_next_comm_timing. A residual larger than 1/4 step (a missed or false
+// zero cross) is clipped. Zc_Jitter is the average residual. comm_tracker_apply
+// scales Wt_Comm and Wt_Zc_Timeout from the 4x average to the predicted next
+// step, so timing keeps up during hard accelerations where the average lags
+//___________________________________________________________________________
+
+void comm_tracker_update(int32 Step) {
+	int32 Pred, Res;
+
+	if (F.STARTUP_PHASE || (Trk_Period == 0)) { // Seed from the measured step
+		Trk_Period = Step << 8;
+		Trk_Rate = Zc_Jitter = 0;
+		return;
+	}
+
+	Pred = Trk_Period + Trk_Rate;
+	Res = Limit1((Step << 8) - Pred, Pred >> 2);
+	Trk_Period = Pred + (Res >> TRK_ALPHA_SHIFT);
+	Trk_Rate += Res >> TRK_BETA_SHIFT;
+	Zc_Jitter += (Abs(Res) - Zc_Jitter) >> TRK_JITTER_SHIFT;
+
+} // comm_tracker_update
+
+void comm_tracker_apply(void) {
+	int32 Next4x, Ratio;
+
+	if (F.STARTUP_PHASE || F.INITIAL_RUN_PHASE || (Trk_Period <= 0)
+			|| (Comm_Period4x == 0))
+		return;
+
+	Next4x = (Trk_Period + Trk_Rate) >> 6; // Predicted next step x4
+	Ratio = Limit((Next4x << 8) / Comm_Period4x, 0x80, 0x200);
+	Wt_Comm = (Wt_Comm * Ratio) >> 8;
+	Wt_Zc_Timeout = (Wt_Zc_Timeout * Ratio) >> 8;
+
+} // comm_tracker_apply
+
+//___________________________________________________________________________
+//
+// Phase asymmetry compensation
+//
+// No assumptions
+// Comparator offsets and winding mismatch make each phase's zero cross come
+// early or late by a fixed amount. A step ending on a late zero cross is long
+// and the one after it short, so each step time deviates from the mean by the
+// difference of its own and the previous step's offset. phase_corr_update
+// collects these deviations over a revolution, sums them back into offsets
+// with zero mean and integrates the residual into Phase_Corr. phase_corr_wait
+// takes the step's offset off Wt_Comm so commutations land evenly spaced
+//___________________________________________________________________________
+
+void phase_corr_reset(void) {
+	int32 s;
+
+	for (s = 0; s < PHASE_STEPS; s++)
+		Phase_Dev[s] = Phase_Corr[s] = 0;
+	Phase_Corr_Max = 0;
+
+} // phase_corr_reset
+
+void phase_corr_update(int32 Step) {
+	int32 s, Done, Mean, Off, Sum, Lim;
+
+	if (F.STARTUP_PHASE || F.INITIAL_RUN_PHASE || (Comm_Period4x == 0))
+		return;
+
+	Done = (runState == run1) ? run6 : runState - 1; // runState has already advanced
+	Mean = Comm_Period4x << 6; // Step time average (8 fractional bits)
+	Lim = Mean >> PHASE_CORR_MAX_SHIFT;
+	Phase_Dev[Done] = Limit1((Step << 8) - Mean, Lim);
+
+	if (Done != run6)
+		return;
+
+	Sum = 0; // Remove acceleration common to all steps
+	for (s = 0; s < PHASE_STEPS; s++)
+		Sum += Phase_Dev[s];
+	Mean = Sum / PHASE_STEPS;
+
+	Off = Sum = 0; // Offsets relative to step 1
+	for (s = 0; s < PHASE_STEPS; s++) {
+		Off += Phase_Dev[s] - Mean;
+		Phase_Dev[s] = Off;
+		Sum += Off;
+	}
+	Mean = Sum / PHASE_STEPS;
+
+	Phase_Corr_Max = 0;
+	for (s = 0; s < PHASE_STEPS; s++) {
+		Phase_Corr[s] = Limit1(Phase_Corr[s] + ((Phase_Dev[s] - Mean) >> PHASE_CORR_SHIFT), Lim);
+		if (Abs(Phase_Corr[s]) > Phase_Corr_Max)
+			Phase_Corr_Max = Abs(Phase_Corr[s]);
+	}
+
+} // phase_corr_update
+
+int32 phase_corr_wait(int32 Step) {
+
+	if (F.STARTUP_PHASE || F.INITIAL_RUN_PHASE || (Wt_Comm <= 0))
+		return (Wt_Comm); // No wait to correct (and the bounds below would cross)
+
+	return (Limit(Wt_Comm - (Phase_Corr[Step] >> 8), 1, Wt_Comm << 1));
+
+} // phase_corr_wait
+
 //___________________________________________________________________________
 //
 // Calculate next commutation timing routine
@@ -2595,6 +3514,8 @@ void calc_next_comm_timing(void) { // Entry point for run phase
  anl	A, #7Fh
  #endif
  Temp2 = A
+ comm_tracker_update((Temp2 << 8) | Temp1);	// Track the new commutation time
+ phase_corr_update((Temp2 << 8) | Temp1);	// Learn the per step zero cross offsets
  // Calculate new commutation time
  Temp3  = Comm_Period4x;	// Comm_Period4x(-l-h) holds the time of 4 commutations
 
@@ -2685,6 +3606,41 @@ void wait_advance_timing(void) {
 	 */
 }
 
+//___________________________________________________________________________
+//
+// Demag predictor
+//
+// No assumptions
+// Predicts the demag duration after commutation from a phase current proxy
+// (pwm x Comm_Period4x, current rises with duty and falls with back emf) and a
+// gain learned from the steps where demag was still present at the zero cross
+// scan. The zero cross blanking Wt_Zc_Scan is stretched from 7.5deg to cover
+// the predicted demag, up to 22.5deg. Power is only cut (wait_for_comm) when
+// the prediction outlasts that, typically on hard throttle chops at low speed
+//___________________________________________________________________________
+
+void demag_predict(void) {
+	int32 Min, Max;
+
+	Demag_Cut_Scheduled = false;
+	if ((Demag_Pwr_Off_Thresh == 255) || F.STARTUP_PHASE || F.INITIAL_RUN_PHASE)
+		return; // Demag compensation off - keep the default blanking
+
+	if (F.DEMAG_ENABLED && F.DEMAG_DETECTED)
+		Demag_Gain += (Demag_Gain >> DEMAG_LEARN_UP_SHIFT) + 1;
+	else
+		Demag_Gain -= Demag_Gain >> DEMAG_LEARN_DOWN_SHIFT;
+	Demag_Gain = Limit(Demag_Gain, DEMAG_GAIN_MIN, DEMAG_GAIN_MAX);
+
+	Demag_Est_Wt = (((Current_Pwm_Limited * Comm_Period4x) >> 8) * Demag_Gain) >> 8;
+
+	Min = Comm_Period4x >> 5; // 7.5deg
+	Max = (Comm_Period4x * 3) >> 5; // 22.5deg
+	Wt_Zc_Scan = Limit(Demag_Est_Wt + (Comm_Period4x >> 6), Min, Max); // 3.75deg margin
+	Demag_Cut_Scheduled = Demag_Est_Wt >= Max;
+
+} // demag_predict
+
 //___________________________________________________________________________
 //
 // Calculate new wait times routine
@@ -2862,6 +3818,14 @@ void calc_new_wait_times(void) {
 	 Wt_Zc_Scan_L, Temp5		// Use this value for zero cross scan delay (7.5deg)
 	 Wt_Zc_Scan_H, Temp6
 	 */
+
+	// Pwm sync window. Comm_Period4x spans 240deg so 1/8deg is Comm_Period4x/1920
+	Comm_Sync_Window = (Comm_Period4x * Comm_Sync_Eighths) / 1920;
+	if (F.PGM_PWM_HIGH_FREQ)
+		Comm_Sync_Window *= 3; // Timer1 counts are 167ns for high pwm frequency
+
+	comm_tracker_apply();
+	demag_predict();
 }
 
 //___________________________________________________________________________
@@ -2938,7 +3902,7 @@ void wait_before_zc_scan(void) {
 void wait_for_comp_out_low(void) {
 
 	F.DEMAG_DETECTED = true; // Set demag detected flag as default
-	Comparator_Read_Cnt = 0;
+	Comparator_Read_Cnt = Zc_Wrong_Step = 0;
 
 	//zzBit_Access 0x00h			// Desired comparator output
 	//zzjmp wait_for_comp_out_start
@@ -2948,7 +3912,7 @@ void wait_for_comp_out_low(void) {
 void wait_for_comp_out_high(void) {
 
 	F.DEMAG_DETECTED = true; // Set demag detected flag as default
-	Comparator_Read_Cnt = 0;
+	Comparator_Read_Cnt = Zc_Wrong_Step = 0;
 	//zzBit_Access,#40h			// Desired comparator output
 
 } // wait_for_comp_out_high
@@ -3017,6 +3981,7 @@ void comp_wait_on_comp_able_not_timed_out(void) {
 	 ajmp	comp_read_ok
 
 	 comp_read_wrong:
+	 Zc_Wrong_Step++;				// Count false crossing for zc_filter_update
 	 jb	F.DEMAG_DETECTED, ($+5)
 	 ajmp	wait_for_comp_out_start		// If comparator output is not correct, and timeout already extended - go back and restart
 
@@ -3057,24 +4022,75 @@ void comp_wait_on_comp_able_not_timed_out(void) {
 	 */
 }
 
+//___________________________________________________________________________
+//
+// Zero cross filter routines
+//
+// No assumptions
+// The number of good comparator readings required (filter depth) is kept per
+// Comm_Period4x band. After each scan the false crossing rate of the band (how
+// often comp_read_wrong was taken) is updated, and every ZC_ADAPT_SCANS scans
+// the depth is raised when the rate is high or lowered when it is low. High
+// speed bands settle at the shortest depth the noise allows. Zc_Scan_Cnt,
+// Zc_Wrong_Cnt and Zc_Depth are read out by the host
+//___________________________________________________________________________
+
+int32 zc_band(void) {
+
+	if (Comm_Period4x <= 0x0500)
+		return (0);
+	else if (Comm_Period4x <= 0x0a00)
+		return (1);
+	else if (Comm_Period4x <= 0x0f00)
+		return (2);
+	else
+		return (3);
+
+} // zc_band
+
+void zc_filter_update(int32 Band) {
+
+	Zc_Scan_Cnt[Band]++;
+	Zc_Wrong_Cnt[Band] += Zc_Wrong_Step;
+
+	if (F.STARTUP_PHASE || F.INITIAL_RUN_PHASE)
+		return;
+
+	Zc_Wrong_Rate[Band] += ((Limit(Zc_Wrong_Step, 0, 255) << 8)
+			- Zc_Wrong_Rate[Band]) >> ZC_RATE_SHIFT;
+
+	if (++Zc_Adapt_Cnt[Band] >= ZC_ADAPT_SCANS) {
+		Zc_Adapt_Cnt[Band] = 0;
+		if ((Zc_Wrong_Rate[Band] > ZC_RATE_HIGH) && (Zc_Depth[Band] < ZC_DEPTH_MAX))
+			Zc_Depth[Band]++;
+		else if ((Zc_Wrong_Rate[Band] < ZC_RATE_LOW) && (Zc_Depth[Band] > 1))
+			Zc_Depth[Band]--;
+	}
+
+} // zc_filter_update
+
+void zc_filter_reset(void) {
+	int32 b;
+
+	for (b = 0; b < ZC_BANDS; b++) {
+		Zc_Depth[b] = ZC_DEPTH_INIT[b];
+		Zc_Wrong_Rate[b] = Zc_Adapt_Cnt[b] = 0;
+		Zc_Scan_Cnt[b] = Zc_Wrong_Cnt[b] = 0;
+	}
+
+} // zc_filter_reset
+
 void wait_for_comp_out_not_timed_out(void) {
+	int32 Band;
 
-	// Set number of comparator readings
-	Temp1 = 1; // Number of OK readings required
-	Temp3 = 2; // Number of fast consecutive readings
-
-	// Set number of readings higher for lower speeds
-	if (Comm_Period4x > 0x0500) {
-		Temp1 = 2;
-		if (Comm_Period4x > 0x0a00) {
-			Temp1 = 3;
-			if (Comm_Period4x > 0x0f00) {
-				Temp3 = 3;
-			}
-		}
+	// Set number of comparator readings for the speed band
+	Band = zc_band();
+	if (F.STARTUP_PHASE) { // Many readings during startup, before speed is known
+		Temp1 = ZC_STARTUP_DEPTH; // Number of OK readings required
+		Temp3 = ZC_STARTUP_FAST_READS; // Number of fast consecutive readings
 	} else {
-		Temp1 = 30;
-		Temp3 = 1;
+		Temp1 = Zc_Depth[Band];
+		Temp3 = ZC_FAST_READS[Band];
 	}
 
 	while (F.T3_PENDING && (Comparator_Read_Cnt == 0))
@@ -3082,6 +4098,8 @@ void wait_for_comp_out_not_timed_out(void) {
 
 	//zzEA=1;							// Enable interrupts
 
+	zc_filter_update(Band);
+
 } // wait_for_comp_out_not_timed_out
 
 //___________________________________________________________________________
@@ -3112,60 +4130,456 @@ void evaluate_comparator_integrity(void) {
 	 dec	SP
 	 ljmp	run_to_wait_for_power_on			// Yes - exit run mode
 
-	 eval_comp_exit:
-	 */
-}
+	 eval_comp_exit:
+	 */
+}
+
+//___________________________________________________________________________
+//
+// Setup commutation timing routine
+//
+// No assumptions
+//
+// Sets up and starts wait from commutation to zero cross
+//
+//___________________________________________________________________________
+void setup_comm_wait(void) {
+
+	Delay1uS(phase_corr_wait(runState));
+	/*
+
+	 Temp1 = phase_corr_wait(runState)	// Set wait commutation value, less this step's zero cross offset
+
+	 #if (MCU_50MHZ==1
+	 C=0;
+	 A = Temp1
+	 rlc	A
+	 Temp1 = A
+	 A = Temp2
+	 rlc	A
+	 Temp2 = A
+	 #endif
+	 TMR3CN, #00h		// Timer3 disabled
+	 anl	TMR3CN, #07Fh		// Clear interrupt flag
+	 C=0;
+	 A=0;
+	 subb	A, Temp1
+	 TMR3L, A
+	 A=0;
+	 subb	A, Temp2
+	 TMR3H, A
+	 TMR3CN, #04h		// Timer3 enabled
+	 // Setup next wait time
+	 Next_Wt= Wt_Advance;
+
+	 F.T3_PENDING = true;
+	 orl	EIE1, #80h		// Enable timer3 interrupts
+	 */
+}
+
+void Clear_RPM_Out(void) {
+
+} // Clear_RPM_Out
+
+void Set_RPM_Out(void) {
+
+} // Set_RPM_Out
+
+#if (STAGE_PROFILE==1)
+//___________________________________________________________________________
+//
+// Stage profile routines
+//
+// No assumptions
+// Accumulates min/max/sum of the cycle counts spent in each main loop stage,
+// per run step. Stage_Profile is read out by the host harness
+//___________________________________________________________________________
+
+void profile_stage(int32 Stage, int32 Step, uint32 Cycles) {
+	struct StageProfileRec *R;
+
+	R = &Stage_Profile[Stage][Step];
+	if ((R->Cnt == 0) || (Cycles < R->Min))
+		R->Min = Cycles;
+	if (Cycles > R->Max)
+		R->Max = Cycles;
+	R->Sum += Cycles;
+	R->Cnt++;
+
+} // profile_stage
+
+void profile_reset(void) {
+	int32 s, r;
+
+	for (s = 0; s < PROF_STAGES; s++)
+		for (r = run1; r <= run6; r++)
+			Stage_Profile[s][r].Min = Stage_Profile[s][r].Max
+					= Stage_Profile[s][r].Sum = Stage_Profile[s][r].Cnt = 0;
+
+} // profile_reset
+#endif
+
+#if (THROTTLE_LATENCY==1)
+//___________________________________________________________________________
+//
+// Throttle latency routines
+//
+// No assumptions
+// latency_rcp_edge is called from pca_int when a new pulse is stored. A change
+// of New_Rcp starts a measurement. latency_pwm_update is called from t2_int
+// after Current_Pwm_Limited is set and latency_gate_change from the pwm on
+// exit of t0_int. A step that leaves the pwm unchanged (clamped by a limit)
+// would otherwise stay pending and be charged to a later unrelated change, so
+// a measurement still pending at the next pulse or after LAT_TIMEOUT_CYCLES
+// is dropped and counted in Lat_Dropped. Percentiles are taken from the
+// histograms by the host
+//___________________________________________________________________________
+
+void latency_hist_add(uint32 *Hist) {
+	uint32 Bin;
+
+	Bin = (Cycle_Count() - Lat_Rcp_Cycles) >> LAT_BIN_SHIFT;
+	if (Bin >= LAT_BINS)
+		Bin = LAT_BINS - 1;
+	Hist[Bin]++;
+
+} // latency_hist_add
+
+void latency_cancel(void) {
+
+	if (Lat_Pwm_Pending || Lat_Gate_Pending)
+		Lat_Dropped++;
+	Lat_Pwm_Pending = Lat_Gate_Pending = false;
+
+} // latency_cancel
+
+void latency_rcp_edge(void) {
+
+	latency_cancel(); // Pulse before the last step reached the output
+
+	if (New_Rcp == Lat_Prev_Rcp)
+		return;
+	Lat_Prev_Rcp = New_Rcp;
+
+	if (F.RCP_PPM_ONESHOT125)
+		Lat_Input = LAT_ONESHOT125;
+	else if (F.RCP_PPM)
+		Lat_Input = LAT_PPM;
+	else
+		Lat_Input = LAT_PWM_INPUT;
+
+	Lat_Rcp_Cycles = Cycle_Count();
+	Lat_Prev_Pwm_Limited = Current_Pwm_Limited;
+	Lat_Pwm_Pending = true;
+	Lat_Gate_Pending = false;
+
+} // latency_rcp_edge
+
+void latency_pwm_update(void) {
+
+	if ((Lat_Pwm_Pending || Lat_Gate_Pending)
+			&& ((Cycle_Count() - Lat_Rcp_Cycles) > LAT_TIMEOUT_CYCLES)) {
+		latency_cancel();
+		return;
+	}
+
+	if (Lat_Pwm_Pending && (Current_Pwm_Limited != Lat_Prev_Pwm_Limited)) {
+		latency_hist_add(Lat_Pwm_Hist[Lat_Input]);
+		Lat_Pwm_Pending = false;
+		Lat_Gate_Pending = true;
+	}
+
+} // latency_pwm_update
+
+void latency_gate_change(void) {
+
+	if (Lat_Gate_Pending) {
+		latency_hist_add(Lat_Gate_Hist[Lat_Input]);
+		Lat_Gate_Pending = false;
+	}
+
+} // latency_gate_change
+#endif
+
+#if (RCP_DETECT_TRACE==1)
+//___________________________________________________________________________
+//
+// RC pulse detection trace routines
+//
+// No assumptions
+// rcp_detect_start is called on every entry to init_no_signal, so a failed
+// pwm frequency measurement or lost pulse counts as a restart. rcp_detect_done
+// is called once the setpoint validates. There is no host replay of captured
+// pulse trains; instead, feed the captured signal to the ESC on the bench and
+// read Rcp_Detect_Mode, Rcp_Detect_Restarts and Rcp_Detect_Cycles over the
+// debug link. The capture shows which input type and arm time to expect
+//___________________________________________________________________________
+
+void rcp_detect_start(void) {
+
+	if (Rcp_Detect_Started)
+		Rcp_Detect_Restarts++;
+	else {
+		Rcp_Detect_Start_Cycles = Cycle_Count();
+		Rcp_Detect_Restarts = 0;
+		Rcp_Detect_Started = true;
+	}
+	Rcp_Detect_Mode = RCP_DET_NONE;
+	Rcp_Detect_Cycles = 0;
+
+} // rcp_detect_start
+
+void rcp_detect_done(void) {
+
+	if (F.RCP_PPM_ONESHOT125)
+		Rcp_Detect_Mode = RCP_DET_ONESHOT125;
+	else if (F.RCP_PPM)
+		Rcp_Detect_Mode = RCP_DET_PPM;
+	else if (F.RCP_PWM_FREQ_12KHZ)
+		Rcp_Detect_Mode = RCP_DET_PWM_12KHZ;
+	else if (F.RCP_PWM_FREQ_8KHZ)
+		Rcp_Detect_Mode = RCP_DET_PWM_8KHZ;
+	else if (F.RCP_PWM_FREQ_4KHZ)
+		Rcp_Detect_Mode = RCP_DET_PWM_4KHZ;
+	else if (F.RCP_PWM_FREQ_2KHZ)
+		Rcp_Detect_Mode = RCP_DET_PWM_2KHZ;
+	else
+		Rcp_Detect_Mode = RCP_DET_PWM_1KHZ;
+
+	Rcp_Detect_Cycles = Cycle_Count() - Rcp_Detect_Start_Cycles;
+	Rcp_Detect_Started = false; // Next entry is a fresh detection
+
+} // rcp_detect_done
+#endif
+
+#if (RUN_STATS==1)
+//___________________________________________________________________________
+//
+// Run statistics routines
+//
+// No assumptions
+// Tracks the highest eRPM reached in run, the number of sync losses and the
+// distribution of step to step timing error (zero cross jitter). CPU headroom
+// per step is the share of the wait stages in Stage_Profile (STAGE_PROFILE)
+//___________________________________________________________________________
+
+void run_stats_update(void) {
+	uint32 Now, Step_Cycles, Err, Bin;
+
+	Now = Cycle_Count();
+	Step_Cycles = Now - Step_Prev_Cycles;
+	Step_Prev_Cycles = Now;
+
+	if (F.STARTUP_PHASE || F.INITIAL_RUN_PHASE) {
+		Step_Mean_Cycles = Step_Cycles;
+		return;
+	}
+
+	if ((Run_Min_Comm_Period4x == 0) || (Comm_Period4x < Run_Min_Comm_Period4x))
+		Run_Min_Comm_Period4x = Comm_Period4x;
+
+	Err = (Step_Cycles > Step_Mean_Cycles) ? Step_Cycles - Step_Mean_Cycles
+			: Step_Mean_Cycles - Step_Cycles;
+	Bin = (Step_Mean_Cycles >= 64) ? Err / (Step_Mean_Cycles >> 6) : 0;
+	if (Bin >= STEP_ERR_BINS)
+		Bin = STEP_ERR_BINS - 1;
+	Step_Err_Hist[Bin]++;
+
+	Step_Mean_Cycles += ((int32) (Step_Cycles - Step_Mean_Cycles)) >> 3; // Average of 8
+
+} // run_stats_update
+
+// Called only from the stall exit in DoHousekeeping. Stop commands, signal
+// loss, failed startups and reversal fallbacks leave run through other
+// paths and are not sync losses
+void run_stats_sync_check(void) {
+
+	if (F.MOTOR_SPINNING && !F.STARTUP_PHASE && (Rcp_Stop_Cnt == 0))
+		Sync_Loss_Cnt++;
+
+} // run_stats_sync_check
+#endif
+
+#if (GOV_STATS==1)
+//___________________________________________________________________________
+//
+// Governor statistics routines
+//
+// No assumptions
+// gov_stats_update is called at the end of every governor update. A target
+// change of GOV_STEP_MIN or more starts a step measurement of overshoot and
+// settling time (updates are GOV_TICKS timer2 ticks apart). Once settled,
+// droop below target measures load and supply disturbance rejection. These
+// take the place of a simulated motor: gain sweeps are run on a real motor
+// with a load step, calling gov_stats_reset between gain settings and reading
+// Gov_Err_Sq_Mean, Gov_Overshoot, Gov_Settle_Updates and Gov_Max_Droop
+//___________________________________________________________________________
+
+void gov_stats_update(int32 Speed, int32 Err) {
+	int32 Past, Band;
+
+	if ((Err * Err) > Gov_Err_Sq_Mean)
+		Gov_Err_Sq_Mean += ((Err * Err) - Gov_Err_Sq_Mean) >> 6;
+	else
+		Gov_Err_Sq_Mean -= (Gov_Err_Sq_Mean - (Err * Err)) >> 6;
+
+	if (Current_Pwm > Gov_Peak_Pwm)
+		Gov_Peak_Pwm = Current_Pwm;
+
+	if (Abs(Gov_Target - Gov_Stats_Target) >= GOV_STEP_MIN) { // New step
+		Gov_Stats_Dir = (Gov_Target > Gov_Stats_Target) ? 1 : -1;
+		Gov_Stats_Target = Gov_Target;
+		Gov_Overshoot = Gov_Settle_Cnt = Gov_In_Band_Cnt = 0;
+		Gov_Settling = true;
+	}
+
+	if (Gov_Settling) {
+		Past = (Speed - Gov_Target) * Gov_Stats_Dir;
+		if (Past > Gov_Overshoot)
+			Gov_Overshoot = Past;
+
+		Band = Gov_Target >> GOV_SETTLE_SHIFT;
+		Gov_Settle_Cnt++;
+		if (Abs(Err) <= Band)
+			Gov_In_Band_Cnt++;
+		else
+			Gov_In_Band_Cnt = 0;
+
+		if (Gov_In_Band_Cnt >= GOV_SETTLE_HOLD) {
+			Gov_Settle_Updates = Gov_Settle_Cnt - GOV_SETTLE_HOLD;
+			Gov_Settling = false;
+		}
+	} else if (Err > Gov_Max_Droop)
+		Gov_Max_Droop = Err;
+
+} // gov_stats_update
+
+int32 gov_stats_rms_err(void) { // 100 eRPM units
+
+	return (isqrt(Gov_Err_Sq_Mean));
+
+} // gov_stats_rms_err
+
+void gov_stats_reset(void) {
+
+	Gov_Stats_Target = Gov_Stats_Dir = Gov_Settle_Cnt = Gov_In_Band_Cnt = 0;
+	Gov_Overshoot = Gov_Settle_Updates = Gov_Max_Droop = Gov_Peak_Pwm = 0;
+	Gov_Err_Sq_Mean = 0;
+	Gov_Settling = false;
+
+} // gov_stats_reset
+#endif
 
+#if (COMM_TRACE==1)
 //___________________________________________________________________________
 //
-// Setup commutation timing routine
+// Commutation trace routines
 //
 // No assumptions
+// comm_trace_record stores one fixed size record per commutation step into
+// the Comm_Trace ring. It is a handful of stores and does not allocate.
+// comm_trace_poll runs in wait_for_power_on, with the motor stopped, and calls
+// comm_trace_dump when COMM_TRACE_DUMP_CMD arrives on the signal wire. The
+// dump sends the ring oldest record first:
 //
-// Sets up and starts wait from commutation to zero cross
+//	byte 0..1	'C' 'T'
+//	byte 2		record size (10)
+//	byte 3		record count (up to COMM_TRACE_SIZE)
+//	byte 4..7	Comm_Trace_Cnt, LSB first (records ever written, gives the
+//				sequence number of the first record as Comm_Trace_Cnt - count)
+//
+// followed by the records, multi byte fields LSB first:
+//
+//	byte 0..1	Comm_Period4x
+//	byte 2..3	Wt_Comm
+//	byte 4..5	Wt_Zc_Scan
+//	byte 6		Demag_Detected_Metric
+//	byte 7		Comparator_Read_Cnt
+//	byte 8		Current_Pwm_Limited
+//	byte 9		runState of the completed step (0..5 for run1..run6)
 //
+// There is no host decoder in this tree. CSV conversion and per step timing
+// histograms are left to a host tool written against this format
 //___________________________________________________________________________
-void setup_comm_wait(void) {
 
-	Delay1uS(Wt_Comm);
-	/*
+void comm_trace_record(int32 Step) {
+	struct CommTraceRec *R;
+
+	R = &Comm_Trace[Comm_Trace_Cnt & (COMM_TRACE_SIZE - 1)];
+	R->Comm_Period4x = Comm_Period4x;
+	R->Wt_Comm = Wt_Comm;
+	R->Wt_Zc_Scan = Wt_Zc_Scan;
+	R->Demag_Detected_Metric = Demag_Detected_Metric;
+	R->Comparator_Read_Cnt = Comparator_Read_Cnt;
+	R->Current_Pwm_Limited = Current_Pwm_Limited;
+	R->runState = Step;
+	Comm_Trace_Cnt++;
+
+} // comm_trace_record
+
+void comm_trace_dump(void) {
+	uint32 Cnt, i, b;
+	uint8 *R;
+
+	Cnt = Comm_Trace_Cnt; // Snapshot so that the header matches the records
+	if (Cnt > COMM_TRACE_SIZE)
+		i = Cnt - COMM_TRACE_SIZE;
+	else
+		i = 0;
+
+	Signal_Wire_Tx('C');
+	Signal_Wire_Tx('T');
+	Signal_Wire_Tx(sizeof(struct CommTraceRec));
+	Signal_Wire_Tx(Cnt - i);
+	for (b = 0; b < 4; b++)
+		Signal_Wire_Tx(Cnt >> (b * 8));
+
+	for (; i < Cnt; i++) {
+		R = (uint8 *) &Comm_Trace[i & (COMM_TRACE_SIZE - 1)];
+		for (b = 0; b < sizeof(struct CommTraceRec); b++)
+			Signal_Wire_Tx(R[b]);
+	}
 
-	 Temp1 = Wt_Comm	// Set wait commutation value
+} // comm_trace_dump
 
-	 #if (MCU_50MHZ==1
-	 C=0;
-	 A = Temp1
-	 rlc	A
-	 Temp1 = A
-	 A = Temp2
-	 rlc	A
-	 Temp2 = A
-	 #endif
-	 TMR3CN, #00h		// Timer3 disabled
-	 anl	TMR3CN, #07Fh		// Clear interrupt flag
-	 C=0;
-	 A=0;
-	 subb	A, Temp1
-	 TMR3L, A
-	 A=0;
-	 subb	A, Temp2
-	 TMR3H, A
-	 TMR3CN, #04h		// Timer3 enabled
-	 // Setup next wait time
-	 Next_Wt= Wt_Advance;
+void comm_trace_poll(void) {
 
-	 F.T3_PENDING = true;
-	 orl	EIE1, #80h		// Enable timer3 interrupts
-	 */
-}
+	if (Signal_Wire_Rx() == COMM_TRACE_DUMP_CMD)
+		comm_trace_dump();
 
-void Clear_RPM_Out(void) {
+} // comm_trace_poll
+#endif
 
-} // Clear_RPM_Out
+//___________________________________________________________________________
+//
+// Wait for pwm edge routine
+//
+// No assumptions
+// Holds commutation until the next pwm on/off edge if that edge is due within
+// Comm_Sync_Window. This avoids a runt pulse on the new phase
+//___________________________________________________________________________
+void wait_for_pwm_edge(void) {
+	int32 Edge_Wait;
+	boolean Pwm_On_Now;
 
-void Set_RPM_Out(void) {
+	if ((Comm_Sync_Window == 0) || F.STARTUP_PHASE)
+		return;
 
-} // Set_RPM_Out
+	// There are no pwm edges at zero or full power
+	if ((Current_Pwm_Limited == 0) || (Current_Pwm_Limited >= 0xff))
+		return;
+
+	Pwm_On_Now = F.PWM_ON;
+	if (Pwm_On_Now)
+		Edge_Wait = Current_Pwm_Limited - TL1; // Remaining on time
+	else
+		Edge_Wait = (0xff - Current_Pwm_Limited) - TL1; // Remaining off time
+
+	if (Edge_Wait <= Comm_Sync_Window)
+		while (F.PWM_ON == Pwm_On_Now) {
+		};
+
+} // wait_for_pwm_edge
 
 //___________________________________________________________________________
 //
@@ -3207,8 +4621,12 @@ void wait_for_comm(void) {
 	 C=0;
 	 A = Demag_Detected_Metric;	// Check demag metric
 	 subb	A, Demag_Pwr_Off_Thresh
-	 jc	wait_for_comm_wait		// Cut power if many consecutive demags. This will help retain sync during hard accelerations
+	 jnc	wait_for_comm_demag_cut	// Cut power if many consecutive demags. This will help retain sync during hard accelerations
 
+	 A = Demag_Cut_Scheduled		// Cut power if predicted demag outlasts the zero cross blanking
+	 jz	wait_for_comm_wait
+
+	 wait_for_comm_demag_cut:
 	 setb	F.DEMAG_CUT_POWER	// Set demag power cut flag
 	 All_nFETs_off();
 	 wait_for_comm_wait();
@@ -3217,9 +4635,14 @@ void wait_for_comm(void) {
 
 void wait_for_comm_wait(void) {
 
+	if (F.T3_PENDING)
+		telem_step(); // Use the wait for one telemetry step
+
 	while (F.T3_PENDING) {
 	};
 
+	wait_for_pwm_edge(); // Hold commutation for a pwm edge that is about to occur
+
 	Next_Wt = Wt_Zc_Scan; // Setup next wait time
 	F.T3_PENDING = true;
 	//zzorl	EIE1, 0x80;			// Enable timer3 interrupts
@@ -3232,7 +4655,10 @@ void wait_for_comm_wait(void) {
 //
 // No assumptions
 //
-// Performs commutation switching
+// Performs commutation switching from COMM_TABLE. A step moving the high side
+// turns all pfets off (precharging the new high side driver when not damped)
+// before the new pfet goes on. A step moving the low side turns the old nfet
+// off and the new one on if in the pwm on cycle
 // Damped routines uses all pfets on when in pwm off to dampen the motor
 //
 //___________________________________________________________________________
@@ -3243,6 +4669,8 @@ void comm_exit(void) {
 	int32 d;
 
 	if (F.DIR_CHANGE_BRAKE) { // Is it a direction change?
+		if (Rev_Brake_Start == 0)
+			Rev_Brake_Start = Cycle_Count() | 1;
 		switch_power_off();
 		FET_DELAY(NFETON_DELAY);
 		FET_DELAY(NFETON_DELAY); // ??
@@ -3256,150 +4684,69 @@ void comm_exit(void) {
 } // comm_exit
 
 
-void comm1comm2(void) {
-	int32 d;
-
-	Set_RPM_Out();
-	//zz EA = 0;
-	All_pFETs_off();
-	if (!F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_cnfet_apBnFET_off;
-		FET_DELAY(NFETON_DELAY);
-	} else {
-#if (HIGH_DRIVER_PRECHG_TIME != 0)	// Precharge high side gate driver
-		if (Comm_Period4x > 8) {
-			AnFET_on();
-			FET_DELAY(HIGH_DRIVER_PRECHG_TIME);
-			AnFET_off();
-			FET_DELAY(PFETON_DELAY);
-		}
-#endif
-	}
-
-	ApFET_on();
-	Set_Comp_Phase_B(); // Set comparator to phase B
-	Comm_Phase = 2;
-
-	comm_exit();
-} // comm1comm2
-
-void comm2comm3(void) {
-
-	Clear_RPM_Out();
-	//zz//zz EA = 0; // Disable all interrupts
-	CnFET_off(); // Cn off
-	if (!F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_bnfet_apBnFET_off;
-		BpFET_off();
-		CpFET_off();
-		FET_DELAY(NFETON_DELAY);
-	} else {
-		DPTR = pwm_bBnFET_off;
-	}
-
-	if (!F.PWM_ON) // Is pwm on?
-		BnFET_on(); // Yes - Bn on
-
-	Set_Comp_Phase_C(); // Set comparator to phase C
-	Comm_Phase = 3;
+void comm_step(void) {
+	CommStep *S;
+	int32 Next, Ph;
 
-	comm_exit();
-} // comm2comm3
+	Next = (runState == run6) ? run1 : runState + 1;
+	S = &COMM_TABLE[F.PGM_DIR_REV][Next];
 
-void comm3comm4(void) {
+	//zz EA = 0; // Disable all interrupts
+	if (S->Tasks & COMM_RPM_OUT_SET)
+		Set_RPM_Out();
+	else if (S->Tasks & COMM_RPM_OUT_CLEAR)
+		Clear_RPM_Out();
 
-	//zzEA=0;
-	All_pFETs_off(); // All pfets off
-	if (F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_bnfet_cpBnFET_off;
-		FET_DELAY(NFETON_DELAY);
-	} else {
+	if (S->High != Comm_High) { // High side moves
+		All_pFETs_off();
+		if (F.PGM_PWMOFF_DAMPED) {
+			FET_DELAY(NFETON_DELAY);
+		} else {
 #if (HIGH_DRIVER_PRECHG_TIME != 0)	// Precharge high side gate driver
-		A = Comm_Period4x_H
-		anl A,0x0F8h // Check if comm period is less than 8
-		jz comm34_prech_done
-		CnFET_on();
-		A = HIGH_DRIVER_PRECHG_TIME
-		djnz ACC, $
-		CnFET_off();
-		PFETON_DELAY();
-		djnz ACC, $
+			if (Comm_Period4x > 8) {
+				NFET_ON[S->High]();
+				FET_DELAY(HIGH_DRIVER_PRECHG_TIME);
+				NFET_OFF[S->High]();
+				FET_DELAY(PFETON_DELAY);
+			}
 #endif
-	}
-
-	CpFET_on();
-	Set_Comp_Phase_A();
-	Comm_Phase = 4;
-
-	comm_exit();
-} // comm3comm4
-
-void comm4comm5(void) {
-
-	//zzclr 	EA					// Disable all interrupts
-	BnFET_off(); // Bn off
-	if (F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_anfet_cpBnFET_off;
-		ApFET_off();
-		BpFET_off();
-		FET_DELAY(NFETON_DELAY);
-	} else {
-		DPTR = pwm_aBnFET_off;
+		}
+		Comm_High = S->High;
+		PFET_ON[Comm_High]();
+	} else { // Low side moves
+		NFET_OFF[Comm_Low]();
+		if (F.PGM_PWMOFF_DAMPED) {
+			for (Ph = PH_A; Ph <= PH_C; Ph++)
+				if (Ph != Comm_High)
+					PFET_OFF[Ph]();
+			FET_DELAY(NFETON_DELAY);
+		}
+		Comm_Prev_Low = Comm_Low;
+		Comm_Low = S->Low;
 		if (F.PWM_ON)
-			AnFET_on();
+			NFET_ON[Comm_Low]();
 	}
+	DPTR = F.PGM_PWMOFF_DAMPED ? pwm_nfet_on_damped : pwm_nfet_on;
 
-	Set_Comp_Phase_B(); // Set comparator to phase B
-	Comm_Phase = 5;
-
-	comm_exit();
-} // comm4comm5
-
-void comm5comm6(void) {
-
-	// clr 	EA					// Disable all interrupts
-	All_pFETs_off(); // All pfets off
-	if (F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_anfet_bpBnFET_off;
-		FET_DELAY(NFETON_DELAY);
-	} else {
-#if (HIGH_DRIVER_PRECHG_TIME != 0)	// Precharge high side gate driver
-		if (Comm_Period4x > 8) {
-			BnFET_on();
-			FET_DELAY(HIGH_DRIVER_PRECHG_TIME);
-			BnFET_off();
-			FET_DELAY(PFETON_DELAY);
-		}
-#endif
-	}
-	BpFET_on();
-	Set_Comp_Phase_C();
-	Comm_Phase = 6;
+	SET_COMP_PHASE[S->Comp]();
+	Comm_Phase = Next + 1;
 
 	comm_exit();
-} // comm5comm6
-
-void comm6comm1(void) {
-
-	// clr 	EA					// Disable all interrupts
-	AnFET_off(); // An off
-	if (F.PGM_PWMOFF_DAMPED) {
-		DPTR = pwm_cnfet_bpBnFET_off;
-		ApFET_off();
-		CpFET_off();
-		FET_DELAY(NFETON_DELAY);
-	} else {
-		DPTR = pwm_cBnFET_off;
-	}
-
-	if (F.PWM_ON)
-		CnFET_on();
-
-	Set_Comp_Phase_A(); // Set comparator to phase A
-	Comm_Phase = 1;
+} // comm_step
+
+void comm_start(void) { // Switch from all fets off to step 1 through step 6
+	CommStep *S = COMM_TABLE[F.PGM_DIR_REV];
+
+	Comm_High = S[run5].High;
+	Comm_Low = S[run5].Low;
+	Comm_Prev_Low = S[run4].Low;
+	runState = run5;
+	comm_step();
+	runState = run6;
+	comm_step();
+	runState = run1;
 
-	comm_exit();
-} // comm6comm1
+} // comm_start
 
 //___________________________________________________________________________
 //
@@ -3448,6 +4795,13 @@ void set_default_parameters(void) {
 	P.Ppm_Center_Throttle = 0xff // center throttle (final value is 4x+1000=1488)
 	P.Main_Spoolup_Time = DEFAULT_PGM_MAIN_SPOOLUP_TIME // main spoolup time
 	P.Temp_Prot_Enable = DEFAULT_PGM_ENABLE_TEMP_PROT // temperature protection enable
+	P.Comm_Pwm_Sync = DEFAULT_PGM_COMM_PWM_SYNC // commutation pwm sync window
+	P.Throttle_Curve = DEFAULT_PGM_THROTTLE_CURVE // throttle curve shape
+	P.Throttle_Curve_Amount = DEFAULT_PGM_THROTTLE_CURVE_AMOUNT // throttle curve amount
+	P.Gov_D_Gain = DEFAULT_PGM_GOV_D_GAIN // governor D gain
+	P.Gov_Feed_Forward = DEFAULT_PGM_GOV_FEED_FORWARD // governor feed forward
+	P.Gov_Gain_Schedule = DEFAULT_PGM_GOV_GAIN_SCHEDULE // governor gain schedule
+	P.Current_Limit = DEFAULT_PGM_CURRENT_LIMIT // current limit
 
 #elif (MODE==TAIL_MODE)
 	P.Gov_P_Gain = 0xff;
@@ -3482,6 +4836,13 @@ void set_default_parameters(void) {
 	P.Ppm_Center_Throttle = DEFAULT_PGM_PPM_CENTER_THROTTLE; // center throttle (final value is 4x+1000=1488)
 	P.Main_Spoolup_Time = 0xff;
 	P.Temp_Prot_Enable = DEFAULT_PGM_ENABLE_TEMP_PROT; // temperature protection enable
+	P.Comm_Pwm_Sync = DEFAULT_PGM_COMM_PWM_SYNC; // commutation pwm sync window
+	P.Throttle_Curve = DEFAULT_PGM_THROTTLE_CURVE; // throttle curve shape
+	P.Throttle_Curve_Amount = DEFAULT_PGM_THROTTLE_CURVE_AMOUNT; // throttle curve amount
+	P.Gov_D_Gain = 0xff;
+	P.Gov_Feed_Forward = 0xff;
+	P.Gov_Gain_Schedule = 0xff;
+	P.Current_Limit = DEFAULT_PGM_CURRENT_LIMIT; // current limit
 #elif (MODE==MULTI_MODE)
 	P.Gov_P_Gain = DEFAULT_PGM_MULTI_P_GAIN; // closed loop P gain
 	P.Gov_I_Gain = DEFAULT_PGM_MULTI_I_GAIN; // closed loop I gain
@@ -3515,6 +4876,13 @@ void set_default_parameters(void) {
 	P.Ppm_Center_Throttle = DEFAULT_PGM_PPM_CENTER_THROTTLE; // center throttle (final value is 4x+1000=1488)
 	P.Main_Spoolup_Time = 0xff;
 	P.Temp_Prot_Enable = DEFAULT_PGM_ENABLE_TEMP_PROT; // temperature protection enable
+	P.Comm_Pwm_Sync = DEFAULT_PGM_COMM_PWM_SYNC; // commutation pwm sync window
+	P.Throttle_Curve = DEFAULT_PGM_THROTTLE_CURVE; // throttle curve shape
+	P.Throttle_Curve_Amount = DEFAULT_PGM_THROTTLE_CURVE_AMOUNT; // throttle curve amount
+	P.Gov_D_Gain = DEFAULT_PGM_GOV_D_GAIN; // closed loop D gain
+	P.Gov_Feed_Forward = DEFAULT_PGM_GOV_FEED_FORWARD; // closed loop feed forward
+	P.Gov_Gain_Schedule = DEFAULT_PGM_GOV_GAIN_SCHEDULE; // closed loop gain schedule
+	P.Current_Limit = DEFAULT_PGM_CURRENT_LIMIT; // current limit
 
 	P.Dummy = 0xffff; // EEPROM address for safety reason
 	//P.Name[] = "                "; // Name tag (16 Bytes)
@@ -3577,6 +4945,10 @@ void decode_parameters(void) {
 		F.PGM_PWM_HIGH_FREQ = true;
 	}
 
+	// Pwm sync window is documented as 0=Off or 1-8 x 1/8deg; anything larger
+	// would hold commutation off for most of a pwm period
+	Comm_Sync_Eighths = Limit(P.Comm_Pwm_Sync, 0, 8);
+
 } // decode_parameters
 
 //___________________________________________________________________________
@@ -3584,27 +4956,32 @@ void decode_parameters(void) {
 // Decode governor gain
 //
 // No assumptions
-// Decodes governor gains
+// Decodes governor gains into the flat schedule arrays, flat at the decoded
+// gain unless P.Gov_Gain_Schedule is set
 //___________________________________________________________________________
+int32 gov_gain_decode(int32 Gain) {
+
+	return (((Gain >= 1) && (Gain <= 13)) ? GOV_GAIN_TABLE[Gain - 1] : 0);
+
+} // gov_gain_decode
+
 void decode_governor_gains(void) {
-	/*
-	 // Decode governor gains
-	 Temp1 = #P.Gov_P_Gain	// Decode governor P gain
-	 A = @Temp1
-	 dec	A
-	 DPTR, #GOV_GAIN_TABLE
-	 movc A, @A+DPTR
-	 Temp1 = #P.Gov_P_Gain_Decoded
-	 @Temp1, A
-	 Temp1 = #P.Gov_I_Gain	// Decode governor I gain
-	 A = @Temp1
-	 dec	A
-	 DPTR, #GOV_GAIN_TABLE
-	 movc A, @A+DPTR
-	 Temp1 = #P.Gov_I_Gain_Decoded
-	 @Temp1, A
-	 switch_power_off();		// Reset DPTR
-	 */
+	int32 i, Kp, Ki, Kd, Mult;
+
+	Kp = gov_gain_decode(P.Gov_P_Gain);
+	Ki = gov_gain_decode(P.Gov_I_Gain);
+	Kd = gov_gain_decode(P.Gov_D_Gain); // 0 is off
+
+	for (i = 0; i < GOV_SCHED_SIZE; i++) {
+		Mult = (P.Gov_Gain_Schedule == 1) ? GOV_SCHED_TABLE[i] : 0x100;
+		Gov_P_Sched[i] = (Kp * Mult) >> 4;
+		Gov_I_Sched[i] = (Ki * Mult) >> 4;
+		Gov_D_Sched[i] = (Kd * Mult) >> 4;
+	}
+
+	Gov_FF_Gain = (Limit(P.Gov_Feed_Forward, 0, 100) << 8) / 100;
+	Gov_Tick_Cnt = GOV_TICKS;
+
 } // decode_governor_gains
 
 
@@ -3674,6 +5051,8 @@ void decode_demag_comp(void) {
 
 	 decode_demag_done:
 	 */
+	Demag_Gain = DEMAG_GAIN_INIT;
+
 } // decode_demag_comp
 
 //___________________________________________________________________________
@@ -3723,51 +5102,39 @@ void set_bec_voltage(void) {
 // The difference between max and min throttle must be more than 520us
 // (a P.Ppm_xxx_Throttle difference of 130)
 //
-// Finds throttle gain from throttle calibration values
+// Finds throttle gain from throttle calibration values. The gain is the
+// reciprocal of the difference with 16 fractional bits, rounded up so that
+// the calibrated maximum maps exactly onto RCP_MAX
 //___________________________________________________________________________
 
 void find_throttle_gain(void) {
-	/*
-
-	 // Load minimum and maximum throttle
-	 Temp1 = #P.Ppm_Min_Throttle
-	 A = @Temp1
-	 Temp3  = A
-	 Temp1 = #P.Ppm_Max_Throttle
-	 A = @Temp1
-	 Temp4, A
-	 // Check if full range is chosen
-	 jnb	F.FULL_THROTTLE_RANGE, find_throttle_gain_calculate
+	int32 Min, Max, Diff, Rcp, Gained;
+
+	// Load minimum and maximum throttle
+	Min = P.Ppm_Min_Throttle;
+	Max = P.Ppm_Max_Throttle;
+	if (F.FULL_THROTTLE_RANGE) { // Check if full range is chosen
+		Min = 0;
+		Max = 255;
+	}
 
-	 Temp3  = #0
-	 Temp4, #255
+	Diff = (Max - Min) & 0xff; // Calculate difference
+	if (Diff < 130) // Check that difference is minimum 130
+		Diff = 130;
 
-	 find_throttle_gain_calculate:
-	 // Calculate difference
-	 C=0;
-	 A = Temp4
-	 subb	A, Temp3
-	 Temp5, A
-	 // Check that difference is minimum 130
-	 C=0;
-	 subb	A, #130
-	 jnc	($+4)
+	// Find gain
+	Ppm_Throttle_Gain = ((RCP_MAX << 16) + Diff - 1) / Diff;
 
-	 Temp5, #130
+	// Fold the gain multiply into the ppm pulse table. Unity gain is 0x10000
+	for (Rcp = 0; Rcp <= RCP_MAX; Rcp++) {
+		Gained = (Rcp * Ppm_Throttle_Gain) >> 16;
+		Ppm_Throttle_Lut[Rcp] = (Gained > RCP_MAX) ? RCP_MAX : Gained;
+	}
+#if (THROTTLE_LUT_CHECK==1)
+	throttle_lut_check();
+#endif
 
-	 // Find gain
-	 Ppm_Throttle_Gain, #0
-	 test_throttle_gain:
-	 inc	Ppm_Throttle_Gain
-	 A = Temp5
-	 B, Ppm_Throttle_Gain	// A has difference, B has gain
-	 mul	AB
-	 C=0;
-	 A = B
-	 subb	A, #128
-	 jc	test_throttle_gain
-	 */
-}
+} // find_throttle_gain
 
 //___________________________________________________________________________
 //
@@ -3940,6 +5307,7 @@ void init_no_signal(void) {
 	set_default_parameters();
 	read_all_eeprom_parameters();
 	decode_parameters();
+	decode_throttle_transfer();
 	decode_governor_gains();
 	decode_startup_power();
 	decode_main_spoolup_time();
@@ -3947,6 +5315,11 @@ void init_no_signal(void) {
 
 	set_bec_voltage();
 	find_throttle_gain();
+	rcp_filter_reset();
+	zc_filter_reset();
+#if (RCP_DETECT_TRACE==1)
+	rcp_detect_start();
+#endif
 
 	switch_power_off();
 
@@ -3975,10 +5348,11 @@ void init_no_signal(void) {
 	 #endif
 	 // Initialize ADC
 	 Initialize_Adc();			// Initialize ADC operation
+	 start_adc_conversion();	// Start continuous dma conversion
 	 Delay1uS(1000);
 	 //zzEA = 1				// Enable all interrupts
 	 // Measure number of lipo cells
-	 Measure_Lipo_Cells();			// Measure number of lipo cells
+	 measure_lipo_cells();			// Measure number of lipo cells
 	 // Initialize rc pulse
 	 Rcp_Int_Enable();		 			// Enable interrupt
 	 Rcp_Clear_Int_Flag(); 				// Clear interrupt flag
@@ -4053,6 +5427,10 @@ void init_no_signal(void) {
 	 subb	A, Temp1						// Higher than validate level?
 	 jc	validate_setpoint_start				// No - start over
 
+	 #if (RCP_DETECT_TRACE==1)
+	 rcp_detect_done();
+	 #endif
+
 	 // Beep arm sequence start signal
 	 clr 	EA							// Disable all interrupts
 	 beep_f1();						// Signal that RC pulse is ready
@@ -4290,7 +5668,14 @@ void init_no_signal(void) {
 	 Delay1mS(100);				// Wait for new RC pulse to be measured
 
 	 wait_for_power_on_no_beep:
-	 Delay1mS(100);
+	 Temp3 = 100;					// Wait 100ms, stepping telemetry every 1ms
+	 wait_for_power_on_telem:
+	 telem_step();
+	 #if (COMM_TRACE==1)
+	 comm_trace_poll();			// Dump the commutation trace if requested over the signal wire
+	 #endif
+	 Delay1mS(1);
+	 djnz	Temp3, wait_for_power_on_telem
 	 A = Rcp_Timeout_Cnt;				// Load RC pulse timeout counter value
 	 jnz	wait_for_power_on_ppm_not_missing	// If it is not zero - proceed
 
@@ -4327,11 +5712,57 @@ void init_no_signal(void) {
 	 */
 }
 
+//___________________________________________________________________________
+//
+// Set startup power limits routine
+//
+// No assumptions
+// Sets the pwm limits and requested pwm to their startup values and clears
+// the initial run phase. Shared by init_start and the fast reversal, which
+// restarts from standstill without going through init_start
+//___________________________________________________________________________
+
+void set_startup_limits(void) {
+
+	F.INITIAL_RUN_PHASE = false;
+
+	// Set max allowed power
+	//zz EA = 0; // Disable interrupts to avoid that Requested_Pwm is overwritten
+	Pwm_Limit = 0xff; // Set pwm limit to max
+	set_startup_pwm();
+	Pwm_Limit = Requested_Pwm;
+	Pwm_Limit_Spoolup = Requested_Pwm;
+	Pwm_Limit_Low_Rpm = Requested_Pwm;
+
+	//zz //zzEA = 1
+	Requested_Pwm = 1; // Set low pwm again after calling set_startup_pwm
+	Current_Pwm = 1;
+	Current_Pwm_Limited = 1;
+	Spoolup_Limit_Cnt = Auto_Bailout_Armed;
+	Spoolup_Limit_Skip = 1;
+
+} // set_startup_limits
+
 //___________________________________________________________________________
 //
 // Start entry point
+//
+// start_commutation commutates into step 1 and begins the startup phase. It
+// is shared by init_start and the bidirectional fast reversal
 //___________________________________________________________________________
 
+void start_commutation(void) {
+
+	F.STARTUP_PHASE = F.MOTOR_SPINNING = true;
+	Startup_Ok_Cnt = 0;
+	comm_start();
+	initialize_all_timings();
+	calc_next_comm_timing();
+	calc_new_wait_times();
+	runState = run1;
+
+} // start_commutation
+
 
 void init_start(void) {
 
@@ -4340,7 +5771,7 @@ void init_start(void) {
 	Requested_Pwm = Governor_Req_Pwm = Current_Pwm = Current_Pwm_Limited = 0;
 	// enable interrupts? //zz EA = 1;
 
-	Gov_Target = Gov_Integral = Gov_Integral_X = 0;
+	Gov_Target = Gov_Integral = Gov_Proportional = Gov_Derivative = 0;
 
 	Gov_Active = false;
 	// clear flags here
@@ -4350,9 +5781,7 @@ void init_start(void) {
 
 	// Motor start beginning
 
-	//zzzCurrent_Average_Temp = GetAverageTemperature();
-
-	check_temp_voltage_and_limit_power();
+	check_voltage_start();
 
 	// Set up start operating conditions
 	Temp1 = P.Pwm_Freq;
@@ -4364,33 +5793,114 @@ void init_start(void) {
 	A = Temp7;
 	Temp1 = Temp7; // Restore settings
 
-	// Set max allowed power
-	//zz EA = 0; // Disable interrupts to avoid that Requested_Pwm is overwritten
-	Pwm_Limit = 0xff; // Set pwm limit to max
-	//zz set_startup_pwm();
-	Pwm_Limit = Requested_Pwm;
-	Pwm_Limit_Spoolup = Requested_Pwm;
-	Pwm_Limit_Low_Rpm = Requested_Pwm;
+	set_startup_limits(); // Set max allowed power
+	start_commutation(); // Begin startup sequence
 
-	//zz //zzEA = 1
-	Requested_Pwm = 1; // Set low pwm again after calling set_startup_pwm
-	Current_Pwm = 1;
-	Current_Pwm_Limited = 1;
-	Spoolup_Limit_Cnt = Auto_Bailout_Armed;
-	Spoolup_Limit_Skip = 1;
+} // init_start
 
-	// Begin startup sequence
+//___________________________________________________________________________
+//
+// Fast reversal
+//
+// No assumptions
+// Bidirectional direction change once the brake has slowed the motor to
+// REV_BRAKE_PERIOD. reverse_track floats the phases for a coast window of
+// REV_WINDOW_US, counts the bemf crossings on the floating phase and
+// averages them into Rev_Rate. The window is sampled once per housekeeping
+// pass, timed by Cycle_Count, and main skips commutation while Rev_Tracking
+// so passes come every few us. Between windows the brake is on. When the
+// crossing rate has fallen to zero the rotor is through zero, and the motor
+// is commutated straight away in the new direction (F.PGM_DIR_REV set by the
+// rc pulse decode selects the reverse COMM_TABLE) from the startup power
+// limits, without the power on and arming path. A stop command aborts the
+// reversal. Rev_Cycles keeps the time from the direction change to the
+// restart
+//___________________________________________________________________________
 
-	F.STARTUP_PHASE = F.MOTOR_SPINNING = true;
-	Startup_Ok_Cnt = 0;
-	comm5comm6();
-	comm6comm1();
-	initialize_all_timings();
-	calc_next_comm_timing();
-	calc_new_wait_times();
-	runState = run1;
+// Returns true when a coast window has closed, with its count in Rev_Crossings
+boolean reverse_bemf_window(void) {
+	int32 Same;
+	uint32 Elapsed;
 
-} // init_start
+	Elapsed = Cycle_Count() - Rev_Phase_Start;
+
+	switch (Rev_Phase) {
+	case REV_BRAKING: // Release the brake and float all phases to see the bemf
+		switch_power_off();
+		SET_COMP_PHASE[COMM_TABLE[F.PGM_DIR_REV][runState].Comp]();
+		Rev_Phase = REV_SETTLING;
+		Rev_Phase_Start = Cycle_Count();
+		break;
+	case REV_SETTLING: // Flyback flips the comparator just after the brake ends
+		if (Elapsed >= (REV_SETTLE_US * REV_CYCLES_PER_US)) {
+			Rev_Level = Comp_Out_Read();
+			Rev_Crossings = 0;
+			Rev_Phase = REV_COASTING;
+			Rev_Phase_Start = Cycle_Count();
+		}
+		break;
+	case REV_COASTING:
+		for (Same = 0; (Same < REV_DEBOUNCE) && (Comp_Out_Read() != Rev_Level); Same++)
+			Delay1uS(REV_SAMPLE_US);
+		if (Same >= REV_DEBOUNCE) {
+			Rev_Level = !Rev_Level;
+			Rev_Crossings++;
+		}
+		if (Elapsed >= (REV_WINDOW_US * REV_CYCLES_PER_US)) {
+			Rev_Phase = REV_BRAKING;
+			return (true);
+		}
+		break;
+	}
+
+	return (false);
+
+} // reverse_bemf_window
+
+int32 reverse_track(void) {
+	int32 Crossings;
+
+	if (Rcp_Stop_Cnt != 0) { // Stop command - no restart
+		Rev_Tracking = false;
+		return (REV_ABORTED);
+	}
+
+	if (!Rev_Tracking) {
+		Rev_Tracking = true;
+		Rev_Phase = REV_BRAKING;
+		Rev_Windows = 0;
+	}
+
+	if (!reverse_bemf_window())
+		return (REV_TRACKING); // Window still open - back to the main loop
+
+	Crossings = Rev_Crossings << 4;
+	if (Rev_Windows == 0)
+		Rev_Rate = Crossings;
+	else
+		Rev_Rate += (Crossings - Rev_Rate) >> REV_RATE_SHIFT;
+
+	if ((Crossings == 0) && (Rev_Rate <= REV_RATE_ZERO)) { // Through zero
+		F.DIR_CHANGE_BRAKE = false;
+		Rev_Tracking = false;
+		set_startup_limits(); // Restart from standstill at startup power
+		start_commutation(); // Commutate in the new direction
+		Rev_Cycles = Cycle_Count() - Rev_Brake_Start;
+		Rev_Brake_Start = 0;
+		Rev_Count++;
+		return (REV_RESTARTED);
+	}
+
+	if (++Rev_Windows >= REV_WINDOWS_MAX) {
+		Rev_Tracking = false;
+		Rev_Fallback_Cnt++;
+		return (REV_ABORTED);
+	}
+
+	All_pFETs_on(); // Brake until the next coast window
+	return (REV_TRACKING);
+
+} // reverse_track
 
 void DoHousekeeping(void) {
 	enum {
@@ -4412,6 +5922,7 @@ void DoHousekeeping(void) {
 		run_to_wait_for_power_on,
 		normal_run_checks,
 		run6_check_setpoint_stop_count,
+		reverse_restart,
 		finished_startup
 	};
 	uint8 startState = initialState;
@@ -4476,19 +5987,36 @@ void DoHousekeeping(void) {
 
 			// Is Comm_Period4x more than 32ms (~1220 eRPM)?
 			if (F.DIR_CHANGE_BRAKE) // Is it a direction change?
-				Temp1 = 0x6000; // Bidirectional minimum speed
+				Temp1 = REV_BRAKE_PERIOD; // Bidirectional brake to low speed
 			else
 				Temp1 = 0xf000; //Default minimum speed
 
-			if (Comm_Period4x > Temp1)
-				startState = run_to_wait_for_power_on; // Yes - go back to motor start
-			else {
+			if (F.DIR_CHANGE_BRAKE && Rev_Tracking)
+				startState = reverse_restart; // Reversal in progress
+			else if (Comm_Period4x > Temp1) { // Yes - reverse or go back to motor start
+				if (F.DIR_CHANGE_BRAKE)
+					startState = reverse_restart;
+				else {
+#if (RUN_STATS==1)
+					run_stats_sync_check(); // Stalled with throttle applied
+#endif
+					startState = run_to_wait_for_power_on;
+				}
+			} else {
 				runState = run1;
 				startState = finished_startup;
 			}
 			break;
+		case reverse_restart:
+			if (reverse_track() == REV_ABORTED)
+				startState = run_to_wait_for_power_on;
+			else // Tracking (back to the main loop until the next window) or restarted
+				startState = finished_startup;
+			break;
 		case run_to_wait_for_power_on:
 
+			F.DIR_CHANGE_BRAKE = Rev_Tracking = false;
+			Rev_Brake_Start = 0;
 			//zzzclr EA
 			switch_power_off();
 			/*
@@ -4504,6 +6032,9 @@ void DoHousekeeping(void) {
 
 			Requested_Pwm = Governor_Req_Pwm = Current_Pwm
 					= Current_Pwm_Limited = Pwm_Motor_Idle = 0;
+#if (MODE==TAIL_MODE)
+			decode_throttle_transfer(); // Idle is folded into Throttle_Lut
+#endif
 			F.MOTOR_SPINNING = false; //Clear motor spinning flag
 
 			//zzEA=1
@@ -4562,78 +6093,51 @@ int main(void) {
 	init_start();
 
 	while (true) {
+		CommStep *S;
+#if (COMM_TRACE==1) || (STAGE_PROFILE==1)
+		int32 Step = runState;
+#endif
 
-		evaluate_comparator_integrity();
-		setup_comm_wait();
-
-		switch (runState) {
-		case run1:
-			// Run 1 = B(p-on) + C(n-pwm) - comparator A evaluated
-			// Out_cA changes from low to high
-			wait_for_comp_out_high(); // Wait zero cross wait and wait for high
-			calc_governor_target(); // Calculate governor target
-			wait_for_comm(); // Wait from zero cross to commutation
-			comm1comm2(); // Commutate
-			runState++;
-			break;
-			// Run 2 = A(p-on) + C(n-pwm) - comparator B evaluated
-			// Out_cB changes from high to low
-		case run2:
-			wait_for_comp_out_low();
-			calc_governor_prop_error();
-			set_pwm_limit_low_rpm();
-			wait_for_comm();
-			comm2comm3();
-			runState++;
-			break;
-			// Run 3 = A(p-on) + B(n-pwm) - comparator C evaluated
-			// Out_cC changes from low to high
-		case run3:
-			wait_for_comp_out_high();
-			calc_governor_int_error();
-			wait_for_comm();
-			comm3comm4();
-			runState++;
-			break;
-			// Run 4 = C(p-on) + B(n-pwm) - comparator A evaluated
-			// Out_cA changes from high to low
-		case run4:
-			wait_for_comp_out_low();
-			evaluate_comparator_integrity();
-			setup_comm_wait();
-			calc_governor_prop_correction();
-			wait_for_comm();
-			comm4comm5();
-			runState++;
-			break;
-			// Run 5 = C(p-on) + A(n-pwm) - comparator B evaluated
-			// Out_cB changes from low to high
-		case run5:
-			wait_for_comp_out_high();
-			calc_governor_int_correction();
-			wait_for_comm();
-			comm5comm6();
-			runState++;
-			break;
-			// Run 6 = B(p-on) + A(n-pwm) - comparator C evaluated
-			// Out_cC changes from high to low
-		case run6:
-			wait_for_comp_out_low();
-			start_adc_conversion();
-			evaluate_comparator_integrity();
-			setup_comm_wait();
-			check_temp_voltage_and_limit_power();
-			wait_for_comm();
-			comm6comm1();
-			runState = run1;
-		} // switch
-
-		calc_next_comm_timing();
-		wait_advance_timing();
-		calc_new_wait_times();
-		wait_before_zc_scan();
-
-		DoHousekeeping();
+		timer2_tick_poll();
+
+		if (Rev_Tracking) { // Coasting through a reversal - no commutation, see reverse_track
+			PROFILE(PROF_HOUSEKEEPING, DoHousekeeping());
+			continue;
+		}
+
+		PROFILE(PROF_EVAL_COMP, evaluate_comparator_integrity());
+		PROFILE(PROF_SETUP_COMM_WAIT, setup_comm_wait());
+
+		S = &COMM_TABLE[F.PGM_DIR_REV][runState];
+		if (S->Rising) {
+			PROFILE(PROF_WAIT_COMP_OUT, wait_for_comp_out_high()); // Wait zero cross wait and wait for high
+		} else {
+			PROFILE(PROF_WAIT_COMP_OUT, wait_for_comp_out_low());
+		}
+		if (S->Tasks & COMM_LOW_RPM_LIMIT) {
+			PROFILE(PROF_POWER_LIMIT, set_pwm_limit_low_rpm());
+		}
+		if (S->Tasks & COMM_EVAL_COMP) {
+			PROFILE(PROF_EVAL_COMP_ZC, evaluate_comparator_integrity());
+			PROFILE(PROF_SETUP_COMM_WAIT_ZC, setup_comm_wait());
+		}
+		PROFILE(PROF_WAIT_FOR_COMM, wait_for_comm()); // Wait from zero cross to commutation
+		PROFILE(PROF_COMM, comm_step()); // Commutate
+		runState = (runState == run6) ? run1 : runState + 1;
+
+		PROFILE(PROF_CALC_NEXT_COMM, calc_next_comm_timing());
+		PROFILE(PROF_WAIT_ADVANCE, wait_advance_timing());
+		PROFILE(PROF_CALC_WAIT_TIMES, calc_new_wait_times());
+		PROFILE(PROF_WAIT_ZC_SCAN, wait_before_zc_scan());
+
+#if (COMM_TRACE==1)
+		comm_trace_record(Step);
+#endif
+#if (RUN_STATS==1)
+		run_stats_update();
+#endif
+
+		PROFILE(PROF_HOUSEKEEPING, DoHousekeeping());
 
 	} // main commutation loop
 